@@ -0,0 +1,394 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../mieliepit.hpp"
+
+using namespace mieliepit;
+
+void mieliepit::quit_primitive_fn(ProgramState &) { }
+void mieliepit::guide_primitive_fn(ProgramState &state) {
+	state.output(state.output_user, guide_text, strlen(guide_text));
+}
+
+namespace {
+
+struct Program {
+	std::string name;
+	std::vector<std::string> lines;
+	std::string expected;
+	bool has_expected;
+};
+
+struct Result {
+	std::string name;
+	size_t reps;
+	double median_ns;
+	double p99_ns;
+	double mean_ns;
+	double min_ns;
+	double ops_per_sec;
+};
+
+struct Options {
+	size_t warmup = 3;
+	size_t reps = 20;
+	bool profile = false;
+	bool update_expected = false;
+	const char *json_path = nullptr;
+	const char *filter = nullptr;
+	std::vector<std::string> paths {};
+};
+
+std::string read_file(const std::filesystem::path &path) {
+	std::ifstream in(path, std::ios::binary);
+	std::stringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+Program load_program(const std::filesystem::path &path) {
+	Program program {
+		.name = path.stem().string(),
+		.lines = {},
+		.expected = {},
+		.has_expected = false,
+	};
+
+	std::ifstream in(path);
+	std::string line;
+	while (std::getline(in, line)) {
+		if (!line.empty()) program.lines.push_back(line);
+	}
+
+	std::filesystem::path expected_path = path;
+	expected_path.replace_extension(".expected");
+	if (std::filesystem::exists(expected_path)) {
+		program.expected = read_file(expected_path);
+		program.has_expected = true;
+	}
+
+	return program;
+}
+
+// sets up a fresh state the way options ask for, before the clock starts
+void prepare_state(ProgramState &state, const Options &options) {
+#ifdef MIELIEPIT_PROFILE
+	state.profile.enabled = options.profile;
+#else
+	(void)state;
+	(void)options;
+#endif
+}
+
+// runs the program once in state, which should be fresh, returning its output,
+// or an empty optional (with the error in `error`) if it failed
+maybe_t<std::string> run_program(ProgramState &state, const Program &program, std::string &error) {
+	std::string output;
+	state.output = [](void *user, const char *data, size_t len) {
+		static_cast<std::string *>(user)->append(data, len);
+	};
+	state.output_user = &output;
+
+	Interpreter interpreter {
+		.line = nullptr,
+		.len = 0,
+		.curr_word = {},
+		.state = state,
+	};
+
+	for (const auto &line : program.lines) {
+		interpreter.line = line.c_str();
+		interpreter.len = line.size();
+		interpreter.curr_word = {};
+
+		while (!state.error && interpreter.len > 0) {
+			interpreter.run_next();
+		}
+
+		if (state.error) {
+			error = state.error;
+			error += " (in line `" + line + "`)";
+			break;
+		}
+	}
+
+	state.output = write_stdout;
+	state.output_user = nullptr;
+
+	if (state.error) return {};
+	return output;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+	const size_t idx = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+maybe_t<Result> bench_program(Program &program, const Options &options, const std::filesystem::path &path) {
+	std::string error;
+
+	ProgramState first_state { primitives, PW_COUNT, syntax, SC_COUNT };
+	prepare_state(first_state, options);
+	const auto output = run_program(first_state, program, error);
+	if (!has(output)) {
+		std::cerr << program.name << ": " << error << '\n';
+		return {};
+	}
+	if (options.update_expected) {
+		std::filesystem::path expected_path = path;
+		expected_path.replace_extension(".expected");
+		std::ofstream(expected_path, std::ios::binary) << get(output);
+	} else if (!program.has_expected) {
+		std::cerr << program.name << ": no .expected file\n";
+		return {};
+	} else if (get(output) != program.expected) {
+		std::cerr << program.name << ": unexpected output\n"
+			<< "expected: " << program.expected << '\n'
+			<< "got:      " << get(output) << '\n';
+		return {};
+	}
+
+	// only the program is timed, not making its state, and every run has to
+	// give the same output, or the times would be for something else
+	std::vector<double> times;
+	for (size_t i = 0; i < options.warmup + options.reps; ++i) {
+		ProgramState state { primitives, PW_COUNT, syntax, SC_COUNT };
+		prepare_state(state, options);
+
+		const auto start = std::chrono::steady_clock::now();
+		const auto rep_output = run_program(state, program, error);
+		const auto end = std::chrono::steady_clock::now();
+
+		if (!has(rep_output)) {
+			std::cerr << program.name << ": " << error << " (in run " << i+1 << ")\n";
+			return {};
+		}
+		if (get(rep_output) != get(output)) {
+			std::cerr << program.name << ": output of run " << i+1 << " differs from the first\n";
+			return {};
+		}
+		if (i >= options.warmup) times.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+	}
+	std::sort(times.begin(), times.end());
+
+	double sum = 0;
+	for (const double t : times) sum += t;
+
+	const double median = percentile(times, 0.5);
+	return Result {
+		.name = program.name,
+		.reps = options.reps,
+		.median_ns = median,
+		.p99_ns = percentile(times, 0.99),
+		.mean_ns = sum / times.size(),
+		.min_ns = times[0],
+		.ops_per_sec = 1e9 / median,
+	};
+}
+
+void print_results(const std::vector<Result> &results) {
+	std::cout << std::left << std::setw(16) << "benchmark" << std::right
+		<< std::setw(14) << "median us"
+		<< std::setw(14) << "p99 us"
+		<< std::setw(14) << "mean us"
+		<< std::setw(14) << "min us"
+		<< std::setw(14) << "runs/s" << '\n';
+	std::cout << std::fixed << std::setprecision(1);
+	for (const auto &result : results) {
+		std::cout << std::left << std::setw(16) << result.name << std::right
+			<< std::setw(14) << result.median_ns / 1000
+			<< std::setw(14) << result.p99_ns / 1000
+			<< std::setw(14) << result.mean_ns / 1000
+			<< std::setw(14) << result.min_ns / 1000
+			<< std::setw(14) << result.ops_per_sec << '\n';
+	}
+}
+
+// one result object per line, so compare_results can read it back without a JSON library
+bool write_json(const char *path, const std::vector<Result> &results) {
+	std::ofstream out(path);
+	if (!out) return false;
+
+	out << std::fixed << std::setprecision(1);
+	out << "{\"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const auto &result = results[i];
+		out << "  {\"name\": \"" << result.name << "\""
+			<< ", \"reps\": " << result.reps
+			<< ", \"median_ns\": " << result.median_ns
+			<< ", \"p99_ns\": " << result.p99_ns
+			<< ", \"mean_ns\": " << result.mean_ns
+			<< ", \"min_ns\": " << result.min_ns
+			<< ", \"ops_per_sec\": " << result.ops_per_sec
+			<< '}' << (i+1 < results.size() ? "," : "") << '\n';
+	}
+	out << "]}\n";
+
+	return static_cast<bool>(out);
+}
+
+maybe_t<double> json_number(const std::string &line, const char *key) {
+	const std::string needle = std::string("\"") + key + "\": ";
+	const size_t at = line.find(needle);
+	if (at == std::string::npos) return {};
+	return strtod(line.c_str() + at + needle.size(), nullptr);
+}
+
+maybe_t<std::map<std::string, double>> read_medians(const char *path) {
+	std::ifstream in(path);
+	if (!in) return {};
+
+	std::map<std::string, double> medians;
+	std::string line;
+	while (std::getline(in, line)) {
+		const std::string needle = "\"name\": \"";
+		const size_t at = line.find(needle);
+		if (at == std::string::npos) continue;
+		const size_t name_start = at + needle.size();
+		const size_t name_end = line.find('"', name_start);
+		const auto median = json_number(line, "median_ns");
+		if (name_end == std::string::npos || !has(median)) continue;
+		medians[line.substr(name_start, name_end - name_start)] = get(median);
+	}
+	return medians;
+}
+
+int compare_results(const char *base_path, const char *new_path, double threshold) {
+	const auto base = read_medians(base_path);
+	const auto current = read_medians(new_path);
+	if (!has(base) || !has(current)) {
+		std::cerr << "could not read " << (has(base) ? new_path : base_path) << '\n';
+		return 2;
+	}
+
+	const auto base_medians = get(base);
+	const auto new_medians = get(current);
+
+	size_t regressions = 0;
+	std::cout << std::left << std::setw(16) << "benchmark" << std::right
+		<< std::setw(14) << "base us"
+		<< std::setw(14) << "new us"
+		<< std::setw(10) << "change" << '\n';
+	std::cout << std::fixed << std::setprecision(1);
+	for (const auto &[name, new_median] : new_medians) {
+		const auto found = base_medians.find(name);
+		if (found == base_medians.end()) {
+			std::cout << std::left << std::setw(16) << name << std::right
+				<< std::setw(14) << "-"
+				<< std::setw(14) << new_median / 1000 << "       new\n";
+			continue;
+		}
+
+		const double change = (new_median / found->second - 1) * 100;
+		std::cout << std::left << std::setw(16) << name << std::right
+			<< std::setw(14) << found->second / 1000
+			<< std::setw(14) << new_median / 1000
+			<< std::setw(9) << std::showpos << change << std::noshowpos << '%';
+		if (change > threshold) {
+			std::cout << "  REGRESSION";
+			++regressions;
+		} else if (change < -threshold) {
+			std::cout << "  improved";
+		}
+		std::cout << '\n';
+	}
+
+	return regressions ? 1 : 0;
+}
+
+void usage(const char *argv0) {
+	std::cerr << "usage: " << argv0 << " [options] [corpus dir or .mp files...]\n"
+		<< "       " << argv0 << " --compare BASE.json NEW.json [--threshold PERCENT]\n"
+		<< "  --warmup N          untimed runs before measuring (default 3)\n"
+		<< "  --reps N            timed runs per program (default 20)\n"
+		<< "  --filter STR        only run programs whose name contains STR\n"
+		<< "  --json FILE         write results to FILE\n"
+		<< "  --profile           run with the profiler enabled (needs -DMIELIEPIT_PROFILE)\n"
+		<< "  --update-expected   overwrite the .expected files with the actual output\n"
+		<< "the corpus defaults to bench/corpus\n";
+}
+
+}
+
+int main(int argc, char **argv) {
+	Options options;
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		if (strcmp(arg, "--compare") == 0 && i+2 < argc) {
+			double threshold = 5;
+			if (i+4 < argc && strcmp(argv[i+3], "--threshold") == 0) {
+				threshold = strtod(argv[i+4], nullptr);
+			}
+			return compare_results(argv[i+1], argv[i+2], threshold);
+		} else if (strcmp(arg, "--warmup") == 0 && i+1 < argc) {
+			options.warmup = strtoul(argv[++i], nullptr, 10);
+		} else if (strcmp(arg, "--reps") == 0 && i+1 < argc) {
+			options.reps = strtoul(argv[++i], nullptr, 10);
+		} else if (strcmp(arg, "--filter") == 0 && i+1 < argc) {
+			options.filter = argv[++i];
+		} else if (strcmp(arg, "--json") == 0 && i+1 < argc) {
+			options.json_path = argv[++i];
+		} else if (strcmp(arg, "--profile") == 0) {
+		#ifndef MIELIEPIT_PROFILE
+			std::cerr << "--profile needs a build with -DMIELIEPIT_PROFILE\n";
+			return 2;
+		#endif
+			options.profile = true;
+		} else if (strcmp(arg, "--update-expected") == 0) {
+			options.update_expected = true;
+		} else if (arg[0] == '-') {
+			usage(argv[0]);
+			return 2;
+		} else {
+			options.paths.push_back(arg);
+		}
+	}
+	if (options.reps == 0) options.reps = 1;
+	if (options.paths.empty()) options.paths.push_back("bench/corpus");
+
+	std::vector<std::filesystem::path> files;
+	for (const auto &path : options.paths) {
+		if (std::filesystem::is_directory(path)) {
+			for (const auto &entry : std::filesystem::directory_iterator(path)) {
+				if (entry.path().extension() == ".mp") files.push_back(entry.path());
+			}
+		} else {
+			files.push_back(path);
+		}
+	}
+	std::sort(files.begin(), files.end());
+
+	std::vector<Result> results;
+	bool failed = false;
+	for (const auto &file : files) {
+		Program program = load_program(file);
+		if (options.filter && program.name.find(options.filter) == std::string::npos) continue;
+
+		const auto result = bench_program(program, options, file);
+		if (has(result)) {
+			results.push_back(get(result));
+		} else {
+			failed = true;
+		}
+	}
+
+	print_results(results);
+
+	if (options.json_path && !write_json(options.json_path, results)) {
+		std::cerr << "could not write " << options.json_path << '\n';
+		return 2;
+	}
+
+	return failed ? 1 : 0;
+}
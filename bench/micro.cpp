@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../mieliepit.hpp"
+
+using namespace mieliepit;
+
+void mieliepit::quit_primitive_fn(ProgramState &) { }
+void mieliepit::guide_primitive_fn(ProgramState &state) {
+	state.output(state.output_user, guide_text, strlen(guide_text));
+}
+
+namespace {
+
+// A snippet measures one primitive or syntax item: the time of `baseline` is
+// subtracted from the time of `code`. The stack is cut back to its initial depth
+// after every iteration (equally for both), so snippets needn't clean up after themselves.
+struct Snippet {
+	std::string name;
+	const char *kind;
+	std::string prelude; // definitions made once, before measuring
+	std::string code;
+	std::string baseline;
+	bool interpret; // can be measured on the interpreter path
+	bool compile; // can be measured inside a compiled word
+	size_t max_iters; // 0 for no limit
+};
+
+// arguments for primitives whose stack effect can't be read from their description,
+// or whose default arguments would change the state
+struct PrimitiveArgs {
+	const char *name;
+	const char *args;
+};
+const PrimitiveArgs primitive_args[] = {
+	{ "rev_n", "1 2 3 3" },
+	{ "nth", "1 2 2" },
+	{ "print_string", "' a 1" },
+	{ "profile", "0" },
+	{ "profile_perf", "0" },
+	{ "trace", "0" },
+	{ "trace_show", "0" },
+	{ "save_image", "\" /dev/null \"" },
+	// stdin, which should be /dev/null (or a file of numbers) so these don't wait for input
+	{ "read_num", "0" },
+	{ "read_nums", "0 16" },
+	// main writes 2 cells to this file first
+	{ "load_cells", "\" /tmp/mieliepit_micro.cells \"" },
+	{ "dump_cells", "3 3 2 \" /dev/null \"" },
+	{ "sum_n", "3 3 3 3 3 3 3 3 8" },
+	{ "prod_n", "3 3 3 3 3 3 3 3 8" },
+	{ "min_n", "3 3 3 3 3 3 3 3 8" },
+	{ "max_n", "3 3 3 3 3 3 3 3 8" },
+	{ "and_n", "3 3 3 3 3 3 3 3 8" },
+	{ "or_n", "3 3 3 3 3 3 3 3 8" },
+	{ "xor_n", "3 3 3 3 3 3 3 3 8" },
+	{ "count_eq_n", "3 3 3 3 3 3 3 3 8 3" },
+	{ "add_n", "3 3 3 3 3 3 3 3 8 3" },
+	{ "sub_n", "3 3 3 3 3 3 3 3 8 3" },
+	{ "mul_n", "3 3 3 3 3 3 3 3 8 3" },
+	{ "shl_n", "3 3 3 3 3 3 3 3 8 3" },
+	{ "shr_n", "3 3 3 3 3 3 3 3 8 3" },
+	{ "cmp_eq_n", "3 3 3 3 3 3 3 3 8 3" },
+	{ "cmp_lt_n", "3 3 3 3 3 3 3 3 8 3" },
+	{ "add_nn", "3 3 3 3 3 3 3 3 4" },
+	{ "sub_nn", "3 3 3 3 3 3 3 3 4" },
+	{ "mul_nn", "3 3 3 3 3 3 3 3 4" },
+	{ "cmp_eq_nn", "3 3 3 3 3 3 3 3 4" },
+	{ "cmp_lt_nn", "3 3 3 3 3 3 3 3 4" },
+	{ "sort_n", "3 1 2 3" },
+	{ "reverse_sort_n", "1 3 2 3" },
+	{ "bsearch_n", "1 2 3 3 2" },
+	{ "uniq_n", "1 1 2 3" },
+	{ "scan_n", "1 2 3 3" },
+	{ "hist_n", "1 2 3 3 0 1 4" },
+	{ "compact_n", "1 2 3 0 1 1 3" },
+	// the others use the bytes Bench allots, with 3 for every address and count
+	{ "allot", "0" },
+};
+
+struct SyntaxSnippet {
+	const char *prelude;
+	const char *code;
+	const char *baseline;
+	bool interpret;
+	bool compile;
+	size_t max_iters;
+};
+// one entry per syntax item, in the order of the syntax array
+const SyntaxSnippet syntax_snippets[] = {
+	[SC_String] = { "", "\" abcdefgh \"", "", true, true, 0 },
+	[SC_Hex] = { "", "hex ff", "", true, true, 0 },
+	[SC_ShortStr] = { "", "' abc", "", true, true, 0 },
+	[SC_Help] = { "", "help dup", "", true, true, 0 },
+	[SC_Def] = { "", "def dup", "", true, true, 0 },
+	[SC_Comment] = { "", "( a comment )", "", true, true, 0 },
+	[SC_TailRec] = {
+		": tr1 ( n -- 0 ) dup ? [ dec tail_rec ] ; : no_tr1 ( n -- 0 ) dup ? [ dec ] ;",
+		"1 tr1", "1 no_tr1", false, true, 0,
+	},
+	[SC_Rec] = {
+		": rec1 ( n -- 0 ) dup ? [ dec rec ] ; : no_rec1 ( n -- 0 ) dup ? [ dec ] ;",
+		"1 rec1", "1 no_rec1", false, true, 0,
+	},
+	[SC_Ret] = { "", "1 ? ret", "1 ? [ ]", false, true, 0 },
+	[SC_Skip] = { "", "1 ? [ ]", "1", true, true, 0 },
+	// every iteration defines another word, which has to fit in the word names buffer
+	[SC_WordDef] = { "", ": mb_def ( -- ) ;", "", true, false, 50 },
+	[SC_RepAnd] = { "", "1 rep_and [ ]", "1", true, true, 0 },
+	[SC_Rep] = { "", "1 rep [ ]", "1", true, true, 0 },
+	[SC_Block] = { "", "[ 1 ]", "1", true, true, 0 },
+	[SC_Time] = { "", "time [ ]", "", true, true, 0 },
+	[SC_PerfStat] = { "", "perf_stat [ ]", "", true, true, 0 },
+	[SC_AnnotatedDef] = { ": mb_adef ( -- ) 1 drop ;", "adef mb_adef", "", true, true, 0 },
+	// measures including a file that was already included (run from the repository root)
+	[SC_Include] = { "include bench/corpus/power.mp", "include bench/corpus/power.mp", "", true, false, 0 },
+	// binds (and defines) labs again every iteration, so it is limited like word definitions
+	[SC_Ffi] = { "", "ffi libc.so.6 labs 1 1", "", true, false, 50 },
+	[SC_FilterN] = { "", "1 2 3 3 filter_n [ 2 < ]", "1 2 3 3", true, true, 0 },
+};
+static_assert(
+	sizeof(syntax_snippets) / sizeof(*syntax_snippets) == SC_COUNT,
+	"Expected a snippet for every syntax item"
+);
+
+// reads the number of inputs from the stack effect `a b -- c` at the start of a description,
+// returning false for variable effects (`...`, `???`)
+bool parse_stack_inputs(const char *desc, size_t &in) {
+	std::istringstream ss(desc);
+	std::string token;
+	in = 0;
+	while (ss >> token && token != ";") {
+		if (token == "--") {
+			return true;
+		} else if (token == "..." || token == "???") {
+			return false;
+		} else {
+			++in;
+		}
+	}
+	return false;
+}
+
+std::string repeat(const char *word, size_t n) {
+	std::string res;
+	for (size_t i = 0; i < n; ++i) {
+		if (i) res += ' ';
+		res += word;
+	}
+	return res;
+}
+
+std::vector<Snippet> generate_snippets() {
+	std::vector<Snippet> snippets;
+
+	for (idx_t i = 0; i < PW_COUNT; ++i) {
+		const Primitive &primitive = primitives[i];
+
+		std::string args;
+		size_t in;
+		const auto override = std::find_if(
+			std::begin(primitive_args), std::end(primitive_args),
+			[&](const PrimitiveArgs &args) { return strcmp(args.name, primitive.name) == 0; }
+		);
+		if (override != std::end(primitive_args)) {
+			args = override->args;
+		} else if (parse_stack_inputs(primitive.desc, in)) {
+			args = repeat("3", in);
+		} else {
+			std::cerr << "skipping `" << primitive.name << "`: unknown stack effect\n";
+			continue;
+		}
+
+		snippets.push_back({
+			.name = primitive.name,
+			.kind = "primitive",
+			.prelude = "",
+			.code = args + " " + primitive.name,
+			.baseline = args,
+			.interpret = true,
+			.compile = true,
+			.max_iters = 0,
+		});
+	}
+
+	for (idx_t i = 0; i < SC_COUNT; ++i) {
+		const SyntaxSnippet &snippet = syntax_snippets[i];
+		snippets.push_back({
+			.name = syntax[i].name,
+			.kind = "syntax",
+			.prelude = snippet.prelude,
+			.code = snippet.code,
+			.baseline = snippet.baseline,
+			.interpret = snippet.interpret,
+			.compile = snippet.compile,
+			.max_iters = snippet.max_iters,
+		});
+	}
+
+	return snippets;
+}
+
+struct Options {
+	double min_time_ms = 5;
+	size_t rounds = 3;
+	std::vector<size_t> depths { 0, 100, 10000 };
+	const char *filter = nullptr;
+};
+
+struct Bench {
+	ProgramState state;
+	Interpreter interpreter;
+	size_t depth = 0;
+
+	void reset_stack() {
+		state.stack.resize(depth);
+	}
+
+	Bench()
+	: state(primitives, PW_COUNT, syntax, SC_COUNT),
+	  interpreter { .line = nullptr, .len = 0, .curr_word = {}, .state = state } {
+		// everything the snippets print goes nowhere
+		state.output = [](void *, const char *, size_t) { };
+		// room for the memory primitives' default arguments
+		state.heap.resize(16);
+	}
+
+	bool interpret(const std::string &line) {
+		state.error = nullptr;
+		interpreter.line = line.c_str();
+		interpreter.len = line.size();
+		interpreter.curr_word = {};
+		while (!state.error && interpreter.len > 0) {
+			interpreter.run_next();
+		}
+		return state.error == nullptr;
+	}
+
+	maybe_t<idx_t> define(const char *name, const std::string &code) {
+		if (!interpret(std::string(": ") + name + " ( -- ) " + code + " ;")) return {};
+		return length(state.words) - 1;
+	}
+};
+
+using clock_type = std::chrono::steady_clock;
+
+// ns per iteration of the fastest round
+maybe_t<double> time_interpreted(Bench &bench, const std::string &code, size_t iters, size_t rounds) {
+	double best = 1e300;
+	for (size_t round = 0; round < rounds; ++round) {
+		const auto start = clock_type::now();
+		for (size_t i = 0; i < iters; ++i) {
+			if (!bench.interpret(code)) return {};
+			bench.reset_stack();
+		}
+		const auto end = clock_type::now();
+		best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / iters);
+	}
+	return best;
+}
+
+maybe_t<double> time_compiled(Bench &bench, idx_t word_idx, size_t iters, size_t rounds) {
+	double best = 1e300;
+	for (size_t round = 0; round < rounds; ++round) {
+		const auto start = clock_type::now();
+		for (size_t i = 0; i < iters; ++i) {
+			bench.interpreter.run_word_idx(word_idx);
+			bench.reset_stack();
+		}
+		const auto end = clock_type::now();
+		if (bench.state.error) return {};
+		best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / iters);
+	}
+	return best;
+}
+
+// picks an iteration count so that one round of the snippet takes at least min_time_ms
+size_t calibrate(Bench &bench, const Snippet &snippet, bool compiled, maybe_t<idx_t> word_idx, const Options &options) {
+	size_t iters = 16;
+	while (true) {
+		if (snippet.max_iters && iters >= snippet.max_iters) return snippet.max_iters;
+
+		const auto time = compiled
+			? time_compiled(bench, get(word_idx), iters, 1)
+			: time_interpreted(bench, snippet.code, iters, 1);
+		if (!has(time) || get(time) * iters >= options.min_time_ms * 1e6 || iters >= (1 << 26)) {
+			return iters;
+		}
+		iters *= 4;
+	}
+}
+
+// returns the cost of the snippet in ns per operation, or a reason why there is none
+std::string measure(const Snippet &snippet, bool compiled, size_t depth, const Options &options) {
+	if (compiled ? !snippet.compile : !snippet.interpret) return "-";
+
+	Bench bench;
+	bench.depth = depth;
+	bench.state.stack.resize(depth, { .pos = 0 });
+	if (!snippet.prelude.empty() && !bench.interpret(snippet.prelude)) return "error";
+
+	maybe_t<idx_t> code_word, baseline_word;
+	if (compiled) {
+		code_word = bench.define("mb_code", snippet.code);
+		baseline_word = bench.define("mb_baseline", snippet.baseline);
+		if (!has(code_word) || !has(baseline_word)) return "error";
+	}
+
+	const size_t iters = calibrate(bench, snippet, compiled, code_word, options);
+	const auto code_time = compiled
+		? time_compiled(bench, get(code_word), iters, options.rounds)
+		: time_interpreted(bench, snippet.code, iters, options.rounds);
+	const auto baseline_time = compiled
+		? time_compiled(bench, get(baseline_word), iters, options.rounds)
+		: time_interpreted(bench, snippet.baseline, iters, options.rounds);
+	if (!has(code_time) || !has(baseline_time)) return "error";
+
+	std::ostringstream res;
+	res << std::fixed << std::setprecision(1) << get(code_time) - get(baseline_time);
+	return res.str();
+}
+
+void usage(const char *argv0) {
+	std::cerr << "usage: " << argv0 << " [--min-time MS] [--rounds N] [--depths A,B,...] [--filter NAME]\n"
+		<< "prints ns/op for every primitive and syntax item, interpreted and compiled,\n"
+		<< "with the given number of cells already on the stack (default depths 0,100,10000)\n";
+}
+
+}
+
+int main(int argc, char **argv) {
+	Options options;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--min-time") == 0 && i+1 < argc) {
+			options.min_time_ms = strtod(argv[++i], nullptr);
+		} else if (strcmp(argv[i], "--rounds") == 0 && i+1 < argc) {
+			options.rounds = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+		} else if (strcmp(argv[i], "--depths") == 0 && i+1 < argc) {
+			options.depths.clear();
+			std::istringstream ss(argv[++i]);
+			std::string depth;
+			while (std::getline(ss, depth, ',')) options.depths.push_back(strtoul(depth.c_str(), nullptr, 10));
+		} else if (strcmp(argv[i], "--filter") == 0 && i+1 < argc) {
+			options.filter = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	const auto snippets = generate_snippets();
+	const number_t cells[] = { { .pos = 3 }, { .pos = 3 } };
+	if (!dump_cells(cells, 2, "/tmp/mieliepit_micro.cells")) {
+		std::cerr << "could not write /tmp/mieliepit_micro.cells, load_cells will fail\n";
+	}
+
+	std::cout << std::left << std::setw(16) << "name" << std::setw(10) << "kind" << std::right;
+	for (const size_t depth : options.depths) {
+		std::cout << std::setw(12) << ("i@" + std::to_string(depth))
+			<< std::setw(12) << ("c@" + std::to_string(depth));
+	}
+	std::cout << "\n";
+
+	for (const auto &snippet : snippets) {
+		if (options.filter && snippet.name != options.filter) continue;
+
+		std::cout << std::left << std::setw(16) << snippet.name << std::setw(10) << snippet.kind << std::right << std::flush;
+		for (const size_t depth : options.depths) {
+			for (const bool compiled : { false, true }) {
+				const std::string cell = measure(snippet, compiled, depth, options);
+				std::cout << std::setw(12) << cell << std::flush;
+			}
+		}
+		std::cout << "\n";
+	}
+}
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# builds the benchmark harness and the primitive microbenchmarks, see bench/README.md
+# extra flags are passed through to the compiler, e.g. `./build_bench.sh -DMIELIEPIT_PROFILE`
+# mieliepit.cpp is big enough that GCC stops inlining std::vector::push_back into the
+# stack primitives under its default inline-unit-growth, which costs up to 2x on some benchmarks
+OPTIMIZE="-O2 --param inline-unit-growth=200"
+SOURCES="mieliepit.cpp mieliepit_image.cpp mieliepit_modules.cpp mieliepit_trace.cpp mieliepit_sampler.cpp mieliepit_native.cpp mieliepit_perf.cpp mieliepit_ffi.cpp"
+g++ -Wall -Wextra -std=c++20 $OPTIMIZE "$@" bench/bench.cpp $SOURCES -o mieliepit_bench -ldl
+g++ -Wall -Wextra -std=c++20 $OPTIMIZE "$@" bench/micro.cpp $SOURCES -o mieliepit_micro -ldl
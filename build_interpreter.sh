@@ -1,3 +1,7 @@
 #!/bin/sh
 
-g++ -Wall -Wextra -std=c++20 -Og -g main.cpp mieliepit.cpp -o mieliepit
+# extra flags are passed through to the compiler,
+# e.g. `./build_interpreter.sh -DMIELIEPIT_PROFILE`
+# (all but mieliepit.cpp are the hosted-only tools: images, modules, traces, profilers and ffi)
+SOURCES="mieliepit.cpp mieliepit_image.cpp mieliepit_modules.cpp mieliepit_trace.cpp mieliepit_sampler.cpp mieliepit_native.cpp mieliepit_perf.cpp mieliepit_ffi.cpp"
+g++ -Wall -Wextra -std=c++20 -Og -g -pthread "$@" main.cpp $SOURCES -o mieliepit -ldl
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+# builds the interpreter as a library for embedding through mieliepit_c.h,
+# as libmieliepit.a and libmieliepit.so (link the static one with -lstdc++ -ldl)
+# extra flags are passed through to the compiler, e.g. `./build_library.sh -DMIELIEPIT_PROFILE`
+# mieliepit.cpp is big enough that GCC stops inlining std::vector::push_back into the
+# stack primitives under its default inline-unit-growth, which costs up to 2x on some benchmarks
+OPTIMIZE="-O2 --param inline-unit-growth=200"
+SOURCES="mieliepit.cpp mieliepit_image.cpp mieliepit_modules.cpp mieliepit_trace.cpp mieliepit_sampler.cpp mieliepit_native.cpp mieliepit_perf.cpp mieliepit_ffi.cpp mieliepit_c.cpp"
+OBJECTS=""
+for source in $SOURCES; do
+	g++ -Wall -Wextra -std=c++20 $OPTIMIZE -fPIC "$@" -c "$source" -o "${source%.cpp}.o" || exit 1
+	OBJECTS="$OBJECTS ${source%.cpp}.o"
+done
+ar rcs libmieliepit.a $OBJECTS &&
+g++ -shared "$@" $OBJECTS -o libmieliepit.so -ldl
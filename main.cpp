@@ -1,21 +1,45 @@
+#include <charconv>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <iostream>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
 
 #include "mieliepit.hpp"
 
 using namespace mieliepit;
 
 bool should_quit = false;
+const char *trace_path = nullptr;
 
 void mieliepit::quit_primitive_fn(ProgramState &) {
 	should_quit = true;
 }
 
-void mieliepit::guide_primitive_fn(ProgramState &) {
-	std::cout << guide_text;
+void mieliepit::guide_primitive_fn(ProgramState &state) {
+	state.output(state.output_user, guide_text, strlen(guide_text));
+}
+
+void dump_trace_on_error(const Interpreter &interpreter) {
+	if (trace_path && interpreter.state.trace.enabled) {
+		if (trace_dump(interpreter.state, trace_path)) {
+			std::cout << "trace written to " << trace_path << std::endl;
+		} else {
+			std::cout << "could not write trace to " << trace_path << std::endl;
+		}
+	}
 }
 
-void interpret_str(Interpreter &interpreter, const std::string str, bool silent = false) {
+void interpret_str(Interpreter &interpreter, const std::string &str, bool silent = false) {
 	interpreter.state.error = nullptr;
 	interpreter.state.error_handled = false;
 
@@ -41,25 +65,402 @@ void interpret_str(Interpreter &interpreter, const std::string str, bool silent
 			std::cout << std::endl;
 		}
 
+		dump_trace_on_error(interpreter);
+
 		interpreter.state.error_handled = true;
 	} else if (!silent) {
 		std::cout << std::endl;
 	}
 }
 
-int main() {
-	ProgramState state {
-		primitives, PW_COUNT,
-		syntax, SC_COUNT,
+// how much of a script is interpreted between letting go of the pages read so far
+constexpr size_t SOURCE_RELEASE_STEP = 4 << 20;
+
+// runs a whole file as one input, so definitions, comments and blocks can span lines;
+// there are no prompts and output is only flushed when the buffer fills or the script ends
+bool run_file(Interpreter &interpreter, const char *path) {
+	const char *error;
+	const auto mapped = map_source(path, &error);
+	if (!has(mapped)) {
+		std::cerr << path << ": " << error << '\n';
+		return false;
+	}
+	const SourceView source = get(mapped);
+
+	interpreter.state.error = nullptr;
+	interpreter.state.error_handled = false;
+	interpreter.set_source(source.data, source.len);
+
+	const char *released = source.data;
+	while (!should_quit && !interpreter.state.error && interpreter.len > 0) {
+		interpreter.run_next();
+		if ((size_t)(interpreter.line - released) >= SOURCE_RELEASE_STEP) {
+			// curr_word may still be needed for an error report
+			released = interpreter.curr_word.text ? interpreter.curr_word.text : interpreter.line;
+			release_source_before(source, released);
+		}
+	}
+	std::cout.flush();
+
+	if (interpreter.state.error) {
+		if (!interpreter.state.error_handled) {
+			std::cout << '\n' << interpreter.state.error << std::endl;
+		}
+
+		const char *at = interpreter.curr_word.len ? interpreter.curr_word.text : interpreter.line;
+		size_t line = 1, column = 1;
+		for (const char *ch = source.data; ch < at; ++ch) {
+			if (*ch == '\n') {
+				++line;
+				column = 1;
+			} else {
+				++column;
+			}
+		}
+		std::cout << "@ " << path << ':' << line << ':' << column;
+		if (interpreter.curr_word.len == 0) {
+			std::cout << ": end of file" << std::endl;
+		} else {
+			std::cout << ": ";
+			std::cout.write(interpreter.curr_word.text, interpreter.curr_word.len);
+			std::cout << std::endl;
+		}
+
+		dump_trace_on_error(interpreter);
+
+		interpreter.state.error_handled = true;
+		unmap_source(source);
+		return false;
+	}
+
+	unmap_source(source);
+	return true;
+}
+
+// Map mode: input records are parsed by a reader thread, run through the word by
+// one or more workers (each with its own copy of the words) and written out in input
+// order by the main thread. Everything is handed along in batches of records through
+// bounded queues, so a slow stage holds up the ones before it instead of buffering the input.
+constexpr size_t MAP_BATCH_RECORDS = 4096;
+constexpr size_t MAP_QUEUE_BATCHES = 4; // per worker
+constexpr size_t MAP_READ_SIZE = 1 << 20;
+
+struct MapOptions {
+	const char *word = nullptr;
+	size_t binary_cells = 0; // cells per record of binary input, 0 for lines of text
+	unsigned workers = 1;
+};
+
+struct MapBatch {
+	std::vector<number_t> cells {};
+	std::vector<size_t> ends {}; // where the cells of each record end
+	std::vector<size_t> numbers {}; // line (or record) number of each record, for errors
+	const char *error = nullptr; // bad input after the last record
+	size_t error_number = 0;
+};
+
+struct MapOutput {
+	std::string text {};
+	const char *error = nullptr;
+	bool error_handled = false;
+	size_t error_number = 0;
+};
+
+template<typename T>
+class BoundedQueue {
+	std::mutex mutex {};
+	std::condition_variable changed {};
+	std::deque<T> items {};
+	size_t capacity;
+	bool closed = false;
+
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) { }
+
+	// waits for room, false if the queue was closed instead
+	bool push(T item) {
+		std::unique_lock lock(mutex);
+		changed.wait(lock, [&] { return closed || items.size() < capacity; });
+		if (closed) return false;
+		items.push_back(std::move(item));
+		changed.notify_all();
+		return true;
+	}
+
+	// waits for an item, nothing once the queue is closed and empty
+	maybe_t<T> pop() {
+		std::unique_lock lock(mutex);
+		changed.wait(lock, [&] { return closed || !items.empty(); });
+		if (items.empty()) return {};
+		T item = std::move(items.front());
+		items.pop_front();
+		changed.notify_all();
+		return item;
+	}
+
+	void close() {
+		std::lock_guard lock(mutex);
+		closed = true;
+		changed.notify_all();
+	}
+};
+
+using MapInputQueues = std::vector<std::unique_ptr<BoundedQueue<MapBatch>>>;
+using MapOutputQueues = std::vector<std::unique_ptr<BoundedQueue<MapOutput>>>;
+
+// appends the whitespace separated integers of a line, false if there is anything else
+bool parse_record(const char *at, const char *end, std::vector<number_t> &cells) {
+	while (true) {
+		while (at < end && Interpreter::is_space(*at)) ++at;
+		if (at == end) return true;
+		const char *token = at;
+		while (at < end && !Interpreter::is_space(*at)) ++at;
+
+		number_t cell;
+		auto res = std::from_chars(token, at, cell.sign);
+		if (res.ec != std::errc() || res.ptr != at) {
+			// too large to be signed is still fine, like for number literals
+			res = std::from_chars(token, at, cell.pos);
+			if (res.ec != std::errc() || res.ptr != at) return false;
+		}
+		cells.push_back(cell);
+	}
+}
+
+// reads stdin until it ends or stop_fd becomes readable, which the caller uses to
+// interrupt a read that may never return
+void map_reader(const MapOptions &options, MapInputQueues &queues, int stop_fd) {
+	std::vector<char> buf(MAP_READ_SIZE);
+	size_t have = 0;
+	size_t number = 0;
+	size_t batches = 0;
+	bool eof = false;
+	MapBatch batch;
+
+	// hands batches to the workers in turn, so their outputs can be collected in turn
+	auto send = [&]() {
+		const bool sent = queues[batches++ % queues.size()]->push(std::move(batch));
+		batch = {};
+		return sent;
+	};
+	auto add = [&]() {
+		batch.ends.push_back(batch.cells.size());
+		batch.numbers.push_back(number);
+		return batch.ends.size() < MAP_BATCH_RECORDS || send();
+	};
+
+	while (!eof && !batch.error) {
+		pollfd fds[2] = {
+			{ .fd = STDIN_FILENO, .events = POLLIN, .revents = 0 },
+			{ .fd = stop_fd, .events = POLLIN, .revents = 0 },
+		};
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			batch.error = "Error: could not read the input";
+			break;
+		}
+		if (fds[1].revents) return;
+
+		const ssize_t got = read(STDIN_FILENO, buf.data() + have, buf.size() - have);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0) {
+			batch.error = "Error: could not read the input";
+			break;
+		}
+		eof = got == 0;
+		have += got;
+
+		size_t used = 0;
+		if (options.binary_cells) {
+			const size_t record_size = options.binary_cells * sizeof(number_t);
+			while (have - used >= record_size) {
+				const size_t at = batch.cells.size();
+				batch.cells.resize(at + options.binary_cells);
+				memcpy(&batch.cells[at], buf.data() + used, record_size);
+				used += record_size;
+				++number;
+				if (!add()) return;
+			}
+			if (eof && used < have) {
+				batch.error = "Error: the input ends in the middle of a record";
+				batch.error_number = number + 1;
+			}
+		} else {
+			while (used < have && !batch.error) {
+				const char *line = buf.data() + used;
+				const char *newline = (const char *)memchr(line, '\n', have - used);
+				if (newline == nullptr && !eof) break;
+				const char *end = newline ? newline : buf.data() + have;
+				used = end - buf.data() + (newline != nullptr);
+				++number;
+
+				const size_t cells_before = batch.cells.size();
+				if (!parse_record(line, end, batch.cells)) {
+					batch.error = "Error: a line contains something other than integers";
+					batch.error_number = number;
+				} else if (batch.cells.size() > cells_before) {
+					if (!add()) return;
+				}
+			}
+		}
+
+		memmove(buf.data(), buf.data() + used, have - used);
+		have -= used;
+		// a line longer than the buffer
+		if (have == buf.size()) buf.resize(buf.size() * 2);
+	}
+
+	if (!batch.ends.empty() || batch.error) send();
+	for (auto &queue : queues) queue->close();
+}
+
+void map_worker(ProgramState &state, Value word, BoundedQueue<MapBatch> &in, BoundedQueue<MapOutput> &out) {
+	Interpreter interpreter {
+		.line = nullptr,
+		.len = 0,
+		.curr_word = {},
+		.state = state,
 	};
 
+	while (true) {
+		auto popped = in.pop();
+		if (!has(popped)) break;
+		const MapBatch &batch = get(popped);
+
+		MapOutput output;
+		size_t begin = 0;
+		for (size_t i = 0; i < batch.ends.size(); ++i) {
+			state.stack.assign(batch.cells.begin() + begin, batch.cells.begin() + batch.ends[i]);
+			begin = batch.ends[i];
+
+			state.error = nullptr;
+			state.error_handled = false;
+			interpreter.run_value(word);
+			if (state.error) {
+				output.error = state.error;
+				output.error_handled = state.error_handled;
+				output.error_number = batch.numbers[i];
+				break;
+			}
+
+			// the stack, bottom first, one record per line
+			for (const number_t cell : state.stack) {
+				char digits[24];
+				const auto res = std::to_chars(digits, digits + sizeof(digits), cell.sign);
+				output.text.append(digits, res.ptr);
+				output.text += ' ';
+			}
+			if (!state.stack.empty()) output.text.pop_back();
+			output.text += '\n';
+		}
+		if (!output.error && batch.error) {
+			output.error = batch.error;
+			output.error_number = batch.error_number;
+		}
+
+		if (!out.push(std::move(output))) break;
+	}
+	out.close();
+}
+
+void write_stderr(void *, const char *data, size_t len) {
+	fwrite(data, 1, len, stderr);
+}
+
+bool write_all(int fd, const char *data, size_t len) {
+	while (len) {
+		const ssize_t wrote = write(fd, data, len);
+		if (wrote < 0 && errno == EINTR) continue;
+		if (wrote <= 0) return false;
+		data += wrote;
+		len -= wrote;
+	}
+	return true;
+}
+
+// runs options.word on every record of stdin, writing what it leaves on the stack to stdout
+bool map_input(ProgramState &state, const MapOptions &options) {
 	Interpreter interpreter {
 		.line = nullptr,
 		.len = 0,
 		.curr_word = {},
 		.state = state,
 	};
+	interpreter.set_source(options.word, strlen(options.word));
+	const auto found = interpreter.read_value();
+	if (!has(found) || (get(found).type != Value::Word && get(found).type != Value::Primitive)) {
+		std::cerr << "map: " << options.word << " is not a word or primitive\n";
+		return false;
+	}
+	const Value word = get(found);
+
+	// the first worker uses state itself, the others copies of its words
+	std::vector<std::unique_ptr<ProgramState>> copies;
+	std::vector<ProgramState *> states { &state };
+	for (unsigned i = 1; i < options.workers; ++i) {
+		copies.push_back(std::make_unique<ProgramState>(primitives, PW_COUNT, syntax, SC_COUNT));
+		copy_words(*copies.back(), state);
+		states.push_back(copies.back().get());
+	}
+
+	MapInputQueues in;
+	MapOutputQueues out;
+	for (unsigned i = 0; i < options.workers; ++i) {
+		in.push_back(std::make_unique<BoundedQueue<MapBatch>>(MAP_QUEUE_BATCHES));
+		out.push_back(std::make_unique<BoundedQueue<MapOutput>>(MAP_QUEUE_BATCHES));
+	}
+
+	// closed to stop the reader
+	int stop_pipe[2];
+	if (pipe(stop_pipe) != 0) {
+		std::cerr << "map: could not create a pipe\n";
+		return false;
+	}
+
+	// what the word prints itself goes to stderr, so stdout only has the results
+	std::cout.flush();
+	for (ProgramState *worker_state : states) worker_state->output = write_stderr;
+
+	std::thread reader(map_reader, std::cref(options), std::ref(in), stop_pipe[0]);
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < options.workers; ++i) {
+		workers.emplace_back(map_worker, std::ref(*states[i]), word, std::ref(*in[i]), std::ref(*out[i]));
+	}
 
+	bool ok = true;
+	for (size_t i = 0; ok; ++i) {
+		auto output = out[i % out.size()]->pop();
+		if (!has(output)) break;
+
+		const MapOutput &res = get(output);
+		if (!write_all(STDOUT_FILENO, res.text.data(), res.text.size())) {
+			std::cerr << "map: could not write the output\n";
+			ok = false;
+		} else if (res.error) {
+			if (!res.error_handled) std::cerr << '\n' << res.error << '\n';
+			std::cerr << "@ " << (options.binary_cells ? "record " : "line ") << res.error_number << '\n';
+			ok = false;
+		}
+	}
+
+	if (!ok) {
+		for (auto &queue : in) queue->close();
+		for (auto &queue : out) queue->close();
+		// the reader may be waiting for input that never comes
+		close(stop_pipe[1]);
+		stop_pipe[1] = -1;
+	}
+	reader.join();
+	for (auto &worker : workers) worker.join();
+	if (stop_pipe[1] != -1) close(stop_pipe[1]);
+	close(stop_pipe[0]);
+
+	state.output = write_stdout;
+	return ok;
+}
+
+// the standard words, defined on every start unless they come from an image
+void define_prelude(Interpreter &interpreter) {
 	interpret_str(interpreter, ": - ( a b -- a-b ) not inc + ;", true);
 	interpret_str(interpreter, ": neg ( a -- -a ) 0 swap - ;", true);
 
@@ -75,8 +476,134 @@ int main() {
 
 	interpret_str(interpreter, ": show_top ( a -- a ; prints the topmost stack element ) dup print ;", true);
 	interpret_str(interpreter, ": clear ( ... - ; clears the stack ) stack_len 0 = ? ret drop rec ;", true);
+}
 
-	while (!should_quit) {
+void usage(const char *argv0) {
+	std::cerr << "usage: " << argv0 << " [--sample FILE] [--sample-hz N] [--trace FILE] [--mem-stats N] [--image FILE]\n"
+		<< "       " << argv0 << " [--perf-map] [--jitdump] [--module-cache DIR | --no-module-cache] [run FILE]\n"
+		<< "       " << argv0 << " [--image FILE] [run FILE] map WORD [--binary N] [--workers N]\n"
+		<< "       " << argv0 << " --decode-trace FILE\n"
+		<< "  --sample FILE        run the sampling profiler, writing collapsed stacks to FILE on exit\n"
+		<< "  --sample-hz N        sampling frequency (default 997)\n"
+		<< "  --trace FILE         trace execution, dumping the last steps to FILE on errors\n"
+		<< "  --mem-stats N        print buffer usage after every N lines, and on exit\n"
+		<< "  --image FILE         start with the words saved by save_image instead of the prelude\n"
+		<< "  --perf-map           call words through trampolines named in /tmp/perf-<pid>.map\n"
+		<< "  --jitdump            like --perf-map, also writing /tmp/jit-<pid>.dump\n"
+		<< "  --module-cache DIR   keep compiled modules in DIR (default $XDG_CACHE_HOME/mieliepit or ~/.cache/mieliepit)\n"
+		<< "  --no-module-cache    always compile included files from source\n"
+		<< "  --decode-trace FILE  print a trace written by --trace\n"
+		<< "  run FILE             run a script instead of reading lines from stdin\n"
+		<< "  map WORD             run WORD on every line of integers on stdin, printing the stack after each\n"
+		<< "  --binary N           read map records of N binary cells instead of lines\n"
+		<< "  --workers N          run map records on N threads (default 1), output stays in input order\n";
+}
+
+int main(int argc, char **argv) {
+	const char *sample_path = nullptr;
+	unsigned sample_hz = 997;
+	unsigned long mem_stats_every = 0;
+	bool perf_map = false;
+	bool jitdump = false;
+	const char *image_path = nullptr;
+	const char *run_path = nullptr;
+	const char *module_cache_dir = nullptr;
+	bool module_cache = true;
+	MapOptions map_options;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--sample") == 0 && i+1 < argc) {
+			sample_path = argv[++i];
+		} else if (strcmp(argv[i], "--sample-hz") == 0 && i+1 < argc) {
+			sample_hz = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+			trace_path = argv[++i];
+		} else if (strcmp(argv[i], "--mem-stats") == 0 && i+1 < argc) {
+			mem_stats_every = strtoul(argv[++i], nullptr, 10);
+		} else if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+			image_path = argv[++i];
+		} else if (strcmp(argv[i], "--perf-map") == 0) {
+			perf_map = true;
+		} else if (strcmp(argv[i], "--jitdump") == 0) {
+			perf_map = jitdump = true;
+		} else if (strcmp(argv[i], "--module-cache") == 0 && i+1 < argc) {
+			module_cache_dir = argv[++i];
+		} else if (strcmp(argv[i], "--no-module-cache") == 0) {
+			module_cache = false;
+		} else if (strcmp(argv[i], "run") == 0 && i+1 < argc) {
+			run_path = argv[++i];
+		} else if (strcmp(argv[i], "map") == 0 && i+1 < argc) {
+			map_options.word = argv[++i];
+		} else if (strcmp(argv[i], "--binary") == 0 && i+1 < argc) {
+			map_options.binary_cells = strtoul(argv[++i], nullptr, 10);
+		} else if (strcmp(argv[i], "--workers") == 0 && i+1 < argc) {
+			map_options.workers = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+		} else if (strcmp(argv[i], "--decode-trace") == 0 && i+1 < argc) {
+			if (!trace_decode(argv[++i])) {
+				std::cerr << "could not decode " << argv[i] << '\n';
+				return 1;
+			}
+			return 0;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	ProgramState state {
+		primitives, PW_COUNT,
+		syntax, SC_COUNT,
+	};
+
+	Interpreter interpreter {
+		.line = nullptr,
+		.len = 0,
+		.curr_word = {},
+		.state = state,
+	};
+
+	if (!module_cache) {
+		// no cache directory, no cache
+	} else if (module_cache_dir) {
+		state.module_cache_dir = module_cache_dir;
+	} else if (const char *xdg_cache = getenv("XDG_CACHE_HOME"); xdg_cache && *xdg_cache) {
+		state.module_cache_dir = std::string(xdg_cache) + "/mieliepit";
+	} else if (const char *home = getenv("HOME"); home && *home) {
+		state.module_cache_dir = std::string(home) + "/.cache/mieliepit";
+	}
+
+	if (image_path) {
+		const char *error;
+		if (!load_image(state, image_path, &error)) {
+			std::cerr << "could not load " << image_path << ": " << error << '\n';
+			return 1;
+		}
+	} else {
+		define_prelude(interpreter);
+	}
+
+	if (trace_path && !trace_enable(state, true)) {
+		std::cerr << "could not allocate the trace ring\n";
+		return 1;
+	}
+
+	if (perf_map && !native_symbols_start(state, jitdump)) {
+		std::cerr << "could not set up native profiler symbols (needs x86-64 Linux and a -DMIELIEPIT_PROFILE build)\n";
+		return 1;
+	}
+
+	if (sample_path && !sampler_start(state, sample_hz)) {
+		std::cerr << "could not start the sampling profiler\n";
+		return 1;
+	}
+
+	bool failed = false;
+	unsigned long lines = 0;
+	if (run_path || map_options.word) {
+		// with map, a script only sets up the words
+		if (run_path) failed = !run_file(interpreter, run_path);
+		if (!failed && map_options.word) failed = !map_input(state, map_options);
+	} else while (!should_quit) {
 		std::cout << "> ";
 		std::string line;
 		std::getline(std::cin, line);
@@ -86,5 +613,24 @@ int main() {
 		}
 
 		interpret_str(interpreter, line);
+
+		if (mem_stats_every && ++lines % mem_stats_every == 0) {
+			print_mem_stats(state, mem_stats(state));
+		}
 	}
+
+	if (mem_stats_every) print_mem_stats(state, mem_stats(state));
+
+	if (perf_map) native_symbols_stop();
+
+	if (sample_path) {
+		sampler_stop();
+		sampler_print_flat(state);
+		if (!sampler_write_folded(state, sample_path)) {
+			std::cerr << "could not write " << sample_path << '\n';
+			return 1;
+		}
+	}
+
+	return failed ? 1 : 0;
 }
@@ -6,61 +6,136 @@
 
 #include "vga.hpp"
 #else
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstddef>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <iostream>
+#include <ctime>
+#include <memory>
 #include <optional>
+#include <string>
 #include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #endif
 
 #include "./mieliepit.hpp"
+#include "./mieliepit_internal.hpp"
 
-namespace {
+namespace mieliepit {
 
-void writestring(const char *str) {
+void writestring(const mieliepit::ProgramState &state, const char *str) {
 #ifdef KERNEL
+	(void)state;
 	term::writestring(str);
 #else
-	std::cout << str;
+	state.output(state.output_user, str, strlen(str));
 #endif
 }
 
-void writestringl(const char *str) {
+void writestringl(const mieliepit::ProgramState &state, const char *str) {
 #ifdef KERNEL
+	(void)state;
 	puts(str);
 #else
-	std::cout << str << std::endl;
+	writestring(state, str);
+	state.output(state.output_user, "\n", 1);
 #endif
 }
 
-void writechar(char ch) {
+void writechar(const mieliepit::ProgramState &state, char ch) {
 #ifdef KERNEL
+	(void)state;
 	term::putchar(ch);
 #else
-	std::cout << ch;
+	state.output(state.output_user, &ch, 1);
 #endif
 }
 
+// right-aligns n in a field of the given width
+void writenum_padded(const mieliepit::ProgramState &state, uint64_t n, size_t width) {
+	char buf[24];
+	size_t len = 0;
+	do {
+		buf[len++] = '0' + n%10;
+		n /= 10;
+	} while (n > 0);
+	while (width > len) {
+		writechar(state, ' ');
+		--width;
+	}
 #ifdef KERNEL
-using ssize_t = int32_t;
-static_assert(sizeof(ssize_t) == sizeof(size_t));
+	while (len --> 0) writechar(state, buf[len]);
+#else
+	std::reverse(buf, buf + len);
+	state.output(state.output_user, buf, len);
 #endif
+}
+
+void writenum_signed(const mieliepit::ProgramState &state, int64_t n) {
+	if (n < 0) writechar(state, '-');
+	writenum_padded(state, n < 0 ? -(uint64_t)n : n, 0);
+}
 
+// left-aligns str in a field of the given width
+void writestring_padded(const mieliepit::ProgramState &state, const char *str, size_t width) {
+	writestring(state, str);
+	for (size_t len = strlen(str); len < width; ++len) writechar(state, ' ');
 }
 
+}
+
+#ifdef KERNEL
+using ssize_t = int32_t;
+static_assert(sizeof(ssize_t) == sizeof(size_t));
+#endif
+
 namespace mieliepit {
 
 ProgramState::ProgramState(const Primitive *primitives, size_t primitives_len, const Syntax *syntax, size_t syntax_len)
 : primitives(primitives), primitives_len(primitives_len), syntax(syntax), syntax_len(syntax_len)
 {
+#ifndef KERNEL
+	output = write_stdout;
+#endif
 	word_names_buf.first = (char(*)[WORD_NAMES_BUF_SIZE])malloc(sizeof(*word_names_buf.first));
 	word_descs_buf.first = (char(*)[WORD_DESCS_BUF_SIZE])malloc(sizeof(*word_descs_buf.first));
 }
 ProgramState::~ProgramState() {
 	free(word_names_buf.first);
 	free(word_descs_buf.first);
+#ifndef KERNEL
+	free(trace.records);
+#endif
+}
+
+#ifndef KERNEL
+void write_stdout(void *, const char *data, size_t len) {
+	fwrite(data, 1, len, stdout);
+}
+#endif
+
+bool trace_enable(ProgramState &state, bool enabled) {
+	if (enabled && state.trace.records == nullptr) {
+	#ifdef KERNEL
+		// the kernel only ever has the one state
+		static TraceRecord records[TRACE_RING_SIZE];
+		state.trace.records = records;
+	#else
+		state.trace.records = (TraceRecord *)malloc(sizeof(TraceRecord) * TRACE_RING_SIZE);
+		if (state.trace.records == nullptr) return false;
+	#endif
+	}
+	state.trace.enabled = enabled;
+	return true;
 }
 
 void ProgramState::define_word(const char *name, size_t name_len, const char *desc, size_t desc_len, idx_t code_pos, size_t code_len) {
@@ -92,22 +167,345 @@ void ProgramState::define_word(const char *name, size_t name_len, const char *de
 	push(words, word);
 }
 
+/*** SECTION: Clocks ***/
+
+// monotonic wall time in nanoseconds, always 0 in the kernel (there is no wall clock)
+uint64_t clock_ns() {
+#ifdef KERNEL
+	return 0;
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// time stamp counter, 0 on architectures without one
+uint64_t clock_cycles() {
+#if defined(__i386__) || defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
 namespace {
 
+/*** SECTION: Hardware counter reports ***/
+
+// prints the counts between before and after, as measured by perf_stat
+void perf_stat_report(const ProgramState &state, const PerfCounts &before, const PerfCounts &after, uint64_t ns) {
+	writestring(state, "perf_stat: ");
+	writenum_padded(state, ns, 0);
+	writestring(state, " ns");
+	if (!perf_open()) {
+		writestring(state, ", hardware counters unavailable: ");
+		writestringl(state, perf_error());
+		return;
+	}
+	writechar(state, '\n');
+
+	for (size_t i = 0; i < PC_COUNT; ++i) {
+		writestring(state, "  ");
+		writestring_padded(state, perf_counter_names[i], 16);
+		if (perf_counter_available((PerfCounter)i)) {
+			writenum_padded(state, after.counts[i] - before.counts[i], 16);
+			writechar(state, '\n');
+		} else {
+			writestringl(state, "             n/a");
+		}
+	}
+}
+
+/*** SECTION: Profiler ***/
+
+#ifdef MIELIEPIT_PROFILE
+#ifdef KERNEL
+constexpr const char *PROFILE_CLOCK_UNIT = "cycles";
+#else
+constexpr const char *PROFILE_CLOCK_UNIT = "ns";
+#endif
+
+uint64_t profile_clock() {
+#ifdef KERNEL
+	return clock_cycles();
+#else
+	return clock_ns();
+#endif
+}
+
+ProfileEntry &profile_entry(Profile &profile, bool is_word, idx_t idx) {
+	ProfileEntries &entries = is_word ? profile.words : profile.primitives;
+	while (length(entries) <= idx) push(entries, ProfileEntry {});
+	return entries[idx];
+}
+
+void profile_enter(ProgramState &state, bool is_word, idx_t idx) {
+	Profile &profile = state.profile;
+	if (length(profile.frames) >= PROFILE_MAX_DEPTH) {
+		++profile.overflow;
+		return;
+	}
+
+	ProfileEntry &entry = profile_entry(profile, is_word, idx);
+	++entry.calls;
+	++entry.active;
+
+	ProfileFrame frame = {
+		.is_word = is_word,
+		.idx = idx,
+		.start = 0,
+		.children = 0,
+		.perf_start = {},
+		.perf_children = {},
+	};
+	if (profile.perf) perf_read(frame.perf_start);
+	frame.start = profile_clock();
+	push(profile.frames, frame);
+}
+
+void profile_exit(ProgramState &state) {
+	const uint64_t now = profile_clock();
+	Profile &profile = state.profile;
+	PerfCounts perf_now;
+	if (profile.perf) perf_read(perf_now);
+
+	if (profile.overflow > 0) {
+		--profile.overflow;
+		return;
+	}
+	// profiling was switched on partway through this call
+	if (length(profile.frames) == 0) return;
+
+	const ProfileFrame frame = pop(profile.frames);
+	const uint64_t elapsed = now - frame.start;
+
+	ProfileEntry &entry = profile_entry(profile, frame.is_word, frame.idx);
+	entry.exclusive += elapsed - frame.children;
+	if (--entry.active == 0) entry.inclusive += elapsed;
+
+	const size_t stack_len = length(state.stack);
+	if (stack_len > entry.max_stack) entry.max_stack = stack_len;
+	if (stack_len > profile.max_stack) profile.max_stack = stack_len;
+
+	PerfCounts perf_elapsed {};
+	if (profile.perf) {
+		for (size_t i = 0; i < PC_COUNT; ++i) {
+			perf_elapsed.counts[i] = perf_now.counts[i] - frame.perf_start.counts[i];
+			entry.perf.counts[i] += perf_elapsed.counts[i] - frame.perf_children.counts[i];
+		}
+	}
+
+	if (length(profile.frames) > 0) {
+		ProfileFrame &parent = profile.frames[length(profile.frames)-1];
+		parent.children += elapsed;
+		for (size_t i = 0; i < PC_COUNT; ++i) {
+			parent.perf_children.counts[i] += perf_elapsed.counts[i];
+		}
+	}
+}
+
+void profile_code(ProgramState &state, idx_t code_offset, uint64_t elapsed) {
+	ProfileCode &code = state.profile.code;
+	while (length(code) <= code_offset) push(code, ProfileCodeEntry {});
+	++code[code_offset].count;
+	code[code_offset].time += elapsed;
+}
+
+// forgets the counts for code past len, when code that ran is popped again,
+// so that whatever is compiled there next starts from zero
+void profile_truncate_code(Profile &profile, size_t len) {
+	while (length(profile.code) > len) pop(profile.code);
+}
+
+// forgets the calls in progress, whose exits profiling may have missed (or will miss)
+void profile_clear_frames(Profile &profile) {
+	while (length(profile.frames) > 0) pop(profile.frames);
+	profile.overflow = 0;
+	for (size_t i = 0; i < length(profile.words); ++i) profile.words[i].active = 0;
+	for (size_t i = 0; i < length(profile.primitives); ++i) profile.primitives[i].active = 0;
+}
+
+}
+
+void profile_reset(Profile &profile) {
+	while (length(profile.words) > 0) pop(profile.words);
+	while (length(profile.primitives) > 0) pop(profile.primitives);
+	while (length(profile.code) > 0) pop(profile.code);
+	profile_clear_frames(profile);
+	profile.max_stack = 0;
+}
+
+namespace {
+
+void profile_report(const ProgramState &state) {
+	const Profile &profile = state.profile;
+
+	struct Row {
+		const char *name;
+		bool is_word;
+		const ProfileEntry *entry;
+	};
+#ifdef KERNEL
+	static Row rows[CODE_BUFFER_SIZE + PW_COUNT];
+	size_t rows_len = 0;
+	auto add_row = [&](Row row) { rows[rows_len++] = row; };
+#else
+	std::vector<Row> rows_vec;
+	auto add_row = [&](Row row) { rows_vec.push_back(row); };
+#endif
+
+	for (idx_t i = 0; i < length(profile.words); ++i) {
+		if (profile.words[i].calls == 0 || i >= length(state.words)) continue;
+		add_row({ state.words[i].name, true, &profile.words[i] });
+	}
+	for (idx_t i = 0; i < length(profile.primitives); ++i) {
+		if (profile.primitives[i].calls == 0 || i >= state.primitives_len) continue;
+		add_row({ state.primitives[i].name, false, &profile.primitives[i] });
+	}
+
+#ifndef KERNEL
+	Row *rows = rows_vec.data();
+	const size_t rows_len = rows_vec.size();
+#endif
+
+	// insertion sort, hottest (by exclusive time) first
+	for (size_t i = 1; i < rows_len; ++i) {
+		const Row row = rows[i];
+		size_t j = i;
+		while (j > 0 && rows[j-1].entry->exclusive < row.entry->exclusive) {
+			rows[j] = rows[j-1];
+			--j;
+		}
+		rows[j] = row;
+	}
+
+	// exclusive hardware counts go in extra columns, if any were collected
+	const bool show_perf = profile.perf && perf_open();
+
+	writestring(state, "      calls   exclusive   inclusive  max stack");
+	if (show_perf) {
+		for (size_t i = 0; i < PC_COUNT; ++i) {
+			if (!perf_counter_available((PerfCounter)i)) continue;
+			writechar(state, ' ');
+			for (size_t len = strlen(perf_counter_names[i]); len < 14; ++len) writechar(state, ' ');
+			writestring(state, perf_counter_names[i]);
+		}
+	}
+	writestring(state, "  name (times in ");
+	writestring(state, PROFILE_CLOCK_UNIT);
+	writestringl(state, ")");
+	for (size_t i = 0; i < rows_len; ++i) {
+		const ProfileEntry &entry = *rows[i].entry;
+		writenum_padded(state, entry.calls, 11);
+		writenum_padded(state, entry.exclusive, 12);
+		writenum_padded(state, entry.inclusive, 12);
+		writenum_padded(state, entry.max_stack, 11);
+		if (show_perf) {
+			for (size_t j = 0; j < PC_COUNT; ++j) {
+				if (perf_counter_available((PerfCounter)j)) writenum_padded(state, entry.perf.counts[j], 15);
+			}
+		}
+		writestring(state, "  ");
+		writestring(state, rows[i].name);
+		writestringl(state, rows[i].is_word ? "" : " (primitive)");
+	}
+	writestring(state, "max stack depth: ");
+	writenum_padded(state, profile.max_stack, 0);
+	writechar(state, '\n');
+}
+#endif
+
+/*** SECTION: Tracing ***/
+
+void print_value(const ProgramState &state, Value value);
+
+const Value *code_base(const ProgramState &state) {
+#ifdef KERNEL
+	return state.code.buffer;
+#else
+	return state.code.data();
+#endif
+}
+
+void trace_record(ProgramState &state, idx_t word_idx, idx_t code_offset, Value value) {
+	TraceRecord &record = state.trace.records[state.trace.head & (TRACE_RING_SIZE-1)];
+	record.word_idx = word_idx;
+	record.code_offset = code_offset;
+	record.value = value;
+	record.stack_len = length(state.stack);
+	record.top = record.stack_len ? stack_peek(state.stack) : number_t { 0 };
+	++state.trace.head;
+}
+
+// prints the location part of a trace line, eg. `fib+3`
+void print_trace_location(const ProgramState &state, const TraceRecord &record) {
+	if (record.code_offset == NO_WORD) {
+		writestring(state, "<interpreter>");
+	} else if (record.word_idx == NO_WORD || record.word_idx >= length(state.words)) {
+	#ifdef KERNEL
+		printf("<block>@%u", record.code_offset);
+	#else
+		writestring(state, "<block>@");
+		writenum_padded(state, record.code_offset, 0);
+	#endif
+	} else {
+		const Word &word = state.words[record.word_idx];
+	#ifdef KERNEL
+		printf("%s+%u", word.name, record.code_offset - word.code_pos);
+	#else
+		writestring(state, word.name);
+		writechar(state, '+');
+		writenum_padded(state, record.code_offset - word.code_pos, 0);
+	#endif
+	}
+}
+
+void trace_show(const ProgramState &state, size_t n) {
+	const uint64_t available = state.trace.head < TRACE_RING_SIZE
+		? state.trace.head
+		: TRACE_RING_SIZE;
+	if (n > available) n = available;
+
+	for (uint64_t i = state.trace.head - n; i < state.trace.head; ++i) {
+		const TraceRecord &record = state.trace.records[i & (TRACE_RING_SIZE-1)];
+		print_trace_location(state, record);
+		writestring(state, ": ");
+		print_value(state, record.value);
+	#ifdef KERNEL
+		printf("  ( depth %u, top %d )\n", record.stack_len, record.top.sign);
+	#else
+		writestring(state, "  ( depth ");
+		writenum_padded(state, record.stack_len, 0);
+		writestring(state, ", top ");
+		writenum_signed(state, record.top.sign);
+		writestringl(state, " )");
+	#endif
+	}
+}
+
 /*** SECTION: Basic runner functions ***/
 
-void run_compiled_section(idx_t code_pos, size_t code_len, ProgramState &state) {
+void run_compiled_section(idx_t code_pos, size_t code_len, ProgramState &state, idx_t word_idx = NO_WORD) {
 	assert(code_pos <= length(state.code));
 	assert(code_pos + code_len <= length(state.code));
 
 	Runner runner = { {
 		.code = &state.code[code_pos],
 		.len = code_len,
-	}, state };
+	}, state, word_idx };
+
+	// the runner must be fully set up before a signal handler can see it
+	runner.parent = state.running;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	state.running = &runner;
 
 	while (!state.error && runner.curr.len > 0) {
 		runner.run_next();
 	}
+
+	state.running = runner.parent;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
 }
 
 void run_word_idx(idx_t word_idx, ProgramState &state);
@@ -115,6 +513,25 @@ void run_primitive_idx(idx_t primitive_idx, ProgramState &state);
 void run_number(number_t number, ProgramState &state);
 void run_function_ptr(function_ptr_t function_ptr, Runner &runner);
 
+}
+
+// the body of run_word_idx, with plain pointer and integer arguments so that
+// trampolines can call it
+void run_word_code(ProgramState *state_ptr, idx_t word_idx) {
+	ProgramState &state = *state_ptr;
+	const auto &word = state.words[word_idx];
+
+#ifdef MIELIEPIT_PROFILE
+	if (state.profile.enabled) profile_enter(state, true, word_idx);
+	run_compiled_section(word.code_pos, word.code_len, state, word_idx);
+	if (state.profile.enabled) profile_exit(state);
+#else
+	run_compiled_section(word.code_pos, word.code_len, state, word_idx);
+#endif
+}
+
+namespace {
+
 void run_word_idx(idx_t word_idx, ProgramState &state) {
 	assert(word_idx < length(state.words));
 
@@ -122,16 +539,29 @@ void run_word_idx(idx_t word_idx, ProgramState &state) {
 	assert(word.code_pos <= length(state.code));
 	assert(word.code_pos + word.code_len <= length(state.code));
 
-	run_compiled_section(word.code_pos, word.code_len, state);
+#if defined(MIELIEPIT_PROFILE) && !defined(KERNEL)
+	if (state.trampolines) {
+		run_word_via_trampoline(word_idx, state);
+		return;
+	}
+#endif
+	run_word_code(&state, word_idx);
 }
 void run_primitive_idx(idx_t primitive_idx, ProgramState &state) {
 	assert(primitive_idx < state.primitives_len);
 
 	const auto &primitives = state.primitives[primitive_idx];
+#ifdef MIELIEPIT_PROFILE
+	if (state.profile.enabled) profile_enter(state, false, primitive_idx);
+	primitives.fun(state);
+	if (state.profile.enabled) profile_exit(state);
+#else
 	primitives.fun(state);
+#endif
 }
 void run_number(number_t number, ProgramState &state) {
 	push(state.stack, number);
+	note_stack_depth(state);
 }
 void run_function_ptr(function_ptr_t function_ptr, Runner &runner) {
 	function_ptr->run(runner);
@@ -160,6 +590,7 @@ void Interpreter::run_number(number_t number) {
 bool Interpreter::run_next() {
 	const auto value = read_value();
 	if (has(value)) {
+		if (state.trace.enabled) trace_record(state, NO_WORD, NO_WORD, get(value));
 		run_value(get(value));
 		return true;
 	} else return false;
@@ -232,7 +663,21 @@ void Runner::run_function_ptr(function_ptr_t function_ptr) {
 bool Runner::run_next() {
 	const auto value = read_value();
 	if (has(value)) {
+		if (state.trace.enabled) {
+			trace_record(state, word_idx, curr.code - 1 - code_base(state), get(value));
+		}
+	#ifdef MIELIEPIT_PROFILE
+		if (state.profile.enabled) {
+			const idx_t code_offset = curr.code - 1 - code_base(state);
+			const uint64_t start = profile_clock();
+			run_value(get(value));
+			profile_code(state, code_offset, profile_clock() - start);
+		} else {
+			run_value(get(value));
+		}
+	#else
 		run_value(get(value));
+	#endif
 		return true;
 	} else return false;
 }
@@ -254,6 +699,470 @@ bool Runner::ignore_next() {
 	} else return false;
 }
 
+/*** SECTION: Range operations ***/
+
+#if defined(__SSE2__) && !defined(KERNEL)
+#define RANGE_SSE2 1
+#else
+#define RANGE_SSE2 0
+#endif
+
+namespace {
+
+// the top n cells of the stack (n may be 0), deepest first
+number_t *stack_top_n(Stack &stack, size_t n) {
+#ifdef KERNEL
+	return stack.buffer + stack.len - n;
+#else
+	return stack.data() + stack.size() - n;
+#endif
+}
+
+void drop_n(Stack &stack, size_t n) {
+#ifdef KERNEL
+	stack.len -= n;
+#else
+	stack.resize(stack.size() - n);
+#endif
+}
+
+// folds the cells in four independent chains, so that each cell doesn't wait for the one before it
+template<typename Op>
+number_t fold_scalar(const number_t *cells, size_t n, number_t identity, Op op) {
+	number_t acc0 = identity, acc1 = identity, acc2 = identity, acc3 = identity;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		acc0 = op(acc0, cells[i]);
+		acc1 = op(acc1, cells[i + 1]);
+		acc2 = op(acc2, cells[i + 2]);
+		acc3 = op(acc3, cells[i + 3]);
+	}
+	for (; i < n; ++i) acc0 = op(acc0, cells[i]);
+	return op(op(acc0, acc1), op(acc2, acc3));
+}
+
+#if RANGE_SSE2
+// the same with two cells per register, for the operations SSE2 has 64 bit versions of
+template<typename VecOp, typename Op>
+number_t fold_sse2(const number_t *cells, size_t n, number_t identity, VecOp vec_op, Op op) {
+	__m128i acc0 = _mm_set1_epi64x(identity.sign), acc1 = acc0;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		acc0 = vec_op(acc0, _mm_loadu_si128((const __m128i*)(cells + i)));
+		acc1 = vec_op(acc1, _mm_loadu_si128((const __m128i*)(cells + i + 2)));
+	}
+	number_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, vec_op(acc0, acc1));
+	number_t result = op(lanes[0], lanes[1]);
+	for (; i < n; ++i) result = op(result, cells[i]);
+	return result;
+}
+#endif
+
+number_t range_sum(const number_t *cells, size_t n) {
+	const auto op = [](number_t a, number_t b) { return number_t { .pos = a.pos + b.pos }; };
+#if RANGE_SSE2
+	return fold_sse2(cells, n, { .pos = 0 }, [](__m128i a, __m128i b) { return _mm_add_epi64(a, b); }, op);
+#else
+	return fold_scalar(cells, n, { .pos = 0 }, op);
+#endif
+}
+
+number_t range_and(const number_t *cells, size_t n) {
+	const auto op = [](number_t a, number_t b) { return number_t { .pos = a.pos & b.pos }; };
+#if RANGE_SSE2
+	return fold_sse2(cells, n, { .sign = -1 }, [](__m128i a, __m128i b) { return _mm_and_si128(a, b); }, op);
+#else
+	return fold_scalar(cells, n, { .sign = -1 }, op);
+#endif
+}
+
+number_t range_or(const number_t *cells, size_t n) {
+	const auto op = [](number_t a, number_t b) { return number_t { .pos = a.pos | b.pos }; };
+#if RANGE_SSE2
+	return fold_sse2(cells, n, { .pos = 0 }, [](__m128i a, __m128i b) { return _mm_or_si128(a, b); }, op);
+#else
+	return fold_scalar(cells, n, { .pos = 0 }, op);
+#endif
+}
+
+number_t range_xor(const number_t *cells, size_t n) {
+	const auto op = [](number_t a, number_t b) { return number_t { .pos = a.pos ^ b.pos }; };
+#if RANGE_SSE2
+	return fold_sse2(cells, n, { .pos = 0 }, [](__m128i a, __m128i b) { return _mm_xor_si128(a, b); }, op);
+#else
+	return fold_scalar(cells, n, { .pos = 0 }, op);
+#endif
+}
+
+// SSE2 has no 64 bit multiply, min or max, so these stay scalar
+number_t range_prod(const number_t *cells, size_t n) {
+	return fold_scalar(cells, n, { .pos = 1 }, [](number_t a, number_t b) { return number_t { .pos = a.pos * b.pos }; });
+}
+
+number_t range_min(const number_t *cells, size_t n) {
+	return fold_scalar(cells, n, cells[0], [](number_t a, number_t b) { return b.sign < a.sign ? b : a; });
+}
+
+number_t range_max(const number_t *cells, size_t n) {
+	return fold_scalar(cells, n, cells[0], [](number_t a, number_t b) { return b.sign > a.sign ? b : a; });
+}
+
+size_t range_count_eq(const number_t *cells, size_t n, number_t x) {
+	size_t count = 0, i = 0;
+#if RANGE_SSE2
+	// SSE2 only compares 32 bit lanes: a cell is equal when both of its halves are
+	const __m128i xs = _mm_set1_epi64x(x.sign);
+	const auto eq = [&](const number_t *at) {
+		const __m128i eq32 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)at), xs);
+		return _mm_and_si128(eq32, _mm_shuffle_epi32(eq32, _MM_SHUFFLE(2, 3, 0, 1)));
+	};
+	// equal lanes are -1, so subtracting them counts
+	__m128i counts0 = _mm_setzero_si128(), counts1 = counts0;
+	for (; i + 4 <= n; i += 4) {
+		counts0 = _mm_sub_epi64(counts0, eq(cells + i));
+		counts1 = _mm_sub_epi64(counts1, eq(cells + i + 2));
+	}
+	number_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(counts0, counts1));
+	count = lanes[0].pos + lanes[1].pos;
+#endif
+	for (; i < n; ++i) count += cells[i].pos == x.pos;
+	return count;
+}
+
+
+// elementwise operations: cell applies one to a pair of cells, and vec (where has_vec)
+// to two pairs at once in SSE2 registers
+struct AddOp {
+	static constexpr bool has_vec = true;
+	static number_t cell(number_t a, number_t b) { return { .pos = a.pos + b.pos }; }
+#if RANGE_SSE2
+	static __m128i vec(__m128i a, __m128i b) { return _mm_add_epi64(a, b); }
+#endif
+};
+struct SubOp {
+	static constexpr bool has_vec = true;
+	static number_t cell(number_t a, number_t b) { return { .pos = a.pos - b.pos }; }
+#if RANGE_SSE2
+	static __m128i vec(__m128i a, __m128i b) { return _mm_sub_epi64(a, b); }
+#endif
+};
+struct MulOp {
+	static constexpr bool has_vec = false; // no 64 bit multiply in SSE2
+	static number_t cell(number_t a, number_t b) { return { .sign = a.sign * b.sign }; }
+};
+// shifts are by the same amount for every cell (so b is the same in both lanes),
+// and by 32 or more give 0 like `shl` and `shr`; the primitives turn those into 64 for vec
+struct ShlOp {
+	static constexpr bool has_vec = true;
+	static number_t cell(number_t a, number_t b) { return { .pos = b.pos >= 32 ? 0 : a.pos << b.pos }; }
+#if RANGE_SSE2
+	static __m128i vec(__m128i a, __m128i b) { return _mm_sll_epi64(a, b); }
+#endif
+};
+struct ShrOp {
+	static constexpr bool has_vec = true;
+	static number_t cell(number_t a, number_t b) { return { .pos = b.pos >= 32 ? 0 : a.pos >> b.pos }; }
+#if RANGE_SSE2
+	static __m128i vec(__m128i a, __m128i b) { return _mm_srl_epi64(a, b); }
+#endif
+};
+struct EqOp {
+	static constexpr bool has_vec = true;
+	static number_t cell(number_t a, number_t b) { return { .sign = a.pos == b.pos ? -1 : 0 }; }
+#if RANGE_SSE2
+	// SSE2 only compares 32 bit lanes: a cell is equal when both of its halves are
+	static __m128i vec(__m128i a, __m128i b) {
+		const __m128i eq32 = _mm_cmpeq_epi32(a, b);
+		return _mm_and_si128(eq32, _mm_shuffle_epi32(eq32, _MM_SHUFFLE(2, 3, 0, 1)));
+	}
+#endif
+};
+struct LtOp {
+	static constexpr bool has_vec = true;
+	static number_t cell(number_t a, number_t b) { return { .sign = a.sign < b.sign ? -1 : 0 }; }
+#if RANGE_SSE2
+	// the sign of a-b, flipped where that overflowed, spread over the whole cell
+	static __m128i vec(__m128i a, __m128i b) {
+		const __m128i diff = _mm_sub_epi64(a, b);
+		const __m128i overflow = _mm_and_si128(_mm_xor_si128(a, b), _mm_xor_si128(diff, a));
+		const __m128i sign = _mm_srai_epi32(_mm_xor_si128(diff, overflow), 31);
+		return _mm_shuffle_epi32(sign, _MM_SHUFFLE(3, 3, 1, 1));
+	}
+#endif
+};
+
+// cells[i] = op(cells[i], other[i]), or op(cells[i], x) without other
+template<typename Op>
+void map_range(number_t *cells, const number_t *other, size_t n, number_t x) {
+	size_t i = 0;
+#if RANGE_SSE2
+	if constexpr (Op::has_vec) {
+		if (other) {
+			for (; i + 2 <= n; i += 2) {
+				const __m128i a = _mm_loadu_si128((const __m128i*)(cells + i));
+				const __m128i b = _mm_loadu_si128((const __m128i*)(other + i));
+				_mm_storeu_si128((__m128i*)(cells + i), Op::vec(a, b));
+			}
+		} else {
+			const __m128i xs = _mm_set1_epi64x(x.sign);
+			for (; i + 2 <= n; i += 2) {
+				const __m128i a = _mm_loadu_si128((const __m128i*)(cells + i));
+				_mm_storeu_si128((__m128i*)(cells + i), Op::vec(a, xs));
+			}
+		}
+	}
+#endif
+	if (other) {
+		for (; i < n; ++i) cells[i] = Op::cell(cells[i], other[i]);
+	} else {
+		for (; i < n; ++i) cells[i] = Op::cell(cells[i], x);
+	}
+}
+
+// signed cells as unsigned keys in the same order (or the reverse order)
+template<bool descending>
+uint64_t sort_key(number_t cell) {
+	const uint64_t key = cell.pos ^ ((uint64_t)1 << (8 * sizeof(number_t) - 1));
+	return descending ? ~key : key;
+}
+
+template<bool descending>
+void insertion_sort(number_t *cells, size_t n) {
+	for (size_t i = 1; i < n; ++i) {
+		const number_t cell = cells[i];
+		size_t j = i;
+		for (; j > 0 && sort_key<descending>(cells[j - 1]) > sort_key<descending>(cell); --j) {
+			cells[j] = cells[j - 1];
+		}
+		cells[j] = cell;
+	}
+}
+
+#ifndef KERNEL
+constexpr size_t RADIX_SORT_MIN = 4096; // below this std::sort wins
+
+// LSD radix sort a byte at a time, with the counts for every byte taken in one pass up front;
+// a byte that is the same in every cell needs no pass of its own
+template<bool descending>
+void radix_sort(number_t *cells, size_t n) {
+	constexpr size_t BYTES = sizeof(number_t);
+	size_t counts[BYTES][256] = {};
+	for (size_t i = 0; i < n; ++i) {
+		const uint64_t key = sort_key<descending>(cells[i]);
+		for (size_t b = 0; b < BYTES; ++b) ++counts[b][(key >> (8 * b)) & 0xff];
+	}
+
+	std::unique_ptr<number_t[]> scratch(new number_t[n]);
+	number_t *from = cells, *to = scratch.get();
+	const uint64_t first_key = sort_key<descending>(cells[0]);
+	for (size_t b = 0; b < BYTES; ++b) {
+		if (counts[b][(first_key >> (8 * b)) & 0xff] == n) continue;
+
+		size_t offsets[256];
+		size_t at = 0;
+		for (size_t digit = 0; digit < 256; ++digit) {
+			offsets[digit] = at;
+			at += counts[b][digit];
+		}
+		for (size_t i = 0; i < n; ++i) {
+			to[offsets[(sort_key<descending>(from[i]) >> (8 * b)) & 0xff]++] = from[i];
+		}
+		std::swap(from, to);
+	}
+	if (from != cells) memcpy(cells, from, n * sizeof(number_t));
+}
+#endif
+
+template<bool descending>
+void sort_range(number_t *cells, size_t n) {
+#ifdef KERNEL
+	// the kernel's stack only holds STACK_SIZE cells
+	insertion_sort<descending>(cells, n);
+#else
+	if (n >= RADIX_SORT_MIN) {
+		radix_sort<descending>(cells, n);
+	} else if (n > 16) {
+		std::sort(cells, cells + n, [](number_t a, number_t b) { return sort_key<descending>(a) < sort_key<descending>(b); });
+	} else {
+		insertion_sort<descending>(cells, n);
+	}
+#endif
+}
+
+// the index of x in cells sorted ascending, or -1
+number_t bsearch_range(const number_t *cells, size_t n, number_t x) {
+	size_t lo = 0, hi = n;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (cells[mid].sign < x.sign) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < n && cells[lo].pos == x.pos) return { .pos = lo };
+	return { .sign = -1 };
+}
+
+// drops cells equal to the one before them, returning how many are left
+size_t uniq_range(number_t *cells, size_t n) {
+	if (n == 0) return 0;
+	size_t len = 1;
+	for (size_t i = 1; i < n; ++i) {
+		if (cells[i].pos != cells[len - 1].pos) cells[len++] = cells[i];
+	}
+	return len;
+}
+
+void scan_range(number_t *cells, size_t n) {
+	for (size_t i = 1; i < n; ++i) cells[i].pos += cells[i - 1].pos;
+}
+
+// keeps the cells whose flag (the matching cell of flags) is nonzero, in order, returning how many;
+// every cell is written, so that keeping it or not is a count rather than a branch
+size_t compact_range(number_t *cells, const number_t *flags, size_t n) {
+	size_t k = 0;
+	for (size_t i = 0; i < n; ++i) {
+		const number_t cell = cells[i];
+		cells[k] = cell;
+		k += flags[i].pos != 0;
+	}
+	return k;
+}
+
+// the same for the cells for which Op::cell(cell, x) is true, comparing two at a time with SSE2
+template<typename Op>
+size_t filter_range(number_t *cells, size_t n, number_t x) {
+	size_t k = 0, i = 0;
+#if RANGE_SSE2
+	const __m128i xs = _mm_set1_epi64x(x.sign);
+	for (; i + 2 <= n; i += 2) {
+		const __m128i pair = _mm_loadu_si128((const __m128i*)(cells + i));
+		const int keep = _mm_movemask_pd(_mm_castsi128_pd(Op::vec(pair, xs)));
+		const number_t a = cells[i], b = cells[i + 1];
+		cells[k] = a;
+		k += keep & 1;
+		cells[k] = b;
+		k += keep >> 1;
+	}
+#endif
+	for (; i < n; ++i) {
+		const number_t cell = cells[i];
+		cells[k] = cell;
+		k += Op::cell(cell, x).pos & 1;
+	}
+	return k;
+}
+
+// filter_n: keeps the cells of the range on top of the stack (under its length) for which
+// the predicate, the pred_len values at pred, leaves a nonzero flag; run runs it once.
+// A predicate of a number and `<` or `=` (like `[ 10 < ]`) is applied without running it
+template<typename RunPred>
+void filter_cells(ProgramState &state, const Value *pred, size_t pred_len, RunPred run) {
+	if (length(state.stack) < 1) {
+		state.error = "Error: filter_n expects a range and its length on the stack";
+		state.error_handled = false;
+		return;
+	}
+	const size_t n = pop(state.stack).pos;
+	if (length(state.stack) < n) {
+		state.error = "Error: filter_n expects a range and its length on the stack";
+		state.error_handled = false;
+		return;
+	}
+	// an index, as running the predicate may move the stack
+	const size_t base = length(state.stack) - n;
+
+	if (pred_len == 2 && pred[0].type == Value::Number && pred[1].type == Value::Primitive
+		&& (pred[1].primitive_idx == PW_Lt || pred[1].primitive_idx == PW_Eq)) {
+		const size_t k = pred[1].primitive_idx == PW_Lt
+			? filter_range<LtOp>(stack_top_n(state.stack, n), n, pred[0].number)
+			: filter_range<EqOp>(stack_top_n(state.stack, n), n, pred[0].number);
+		drop_n(state.stack, n - k);
+		push(state.stack, { .pos = k });
+		return;
+	}
+
+	size_t k = 0;
+	for (size_t i = 0; i < n; ++i) {
+		const number_t cell = state.stack[base + i];
+		push(state.stack, cell);
+		note_stack_depth(state);
+		run();
+		if (state.error) return;
+		if (length(state.stack) != base + n + 1) {
+			state.error = "Error: the predicate of filter_n should turn a cell into one flag";
+			state.error_handled = false;
+			return;
+		}
+		if (pop(state.stack).pos != 0) state.stack[base + k++] = cell;
+	}
+	drop_n(state.stack, n - k);
+	push(state.stack, { .pos = k });
+}
+}
+
+/*** SECTION: Linear memory ***/
+
+namespace {
+
+uint8_t *heap_data(Heap &heap) {
+#ifdef KERNEL
+	return heap.buffer;
+#else
+	return heap.data();
+#endif
+}
+
+// whether the n bytes at addr are all inside the heap; wild addresses (like negative numbers) can't wrap around
+bool heap_in_bounds(const Heap &heap, size_t addr, size_t n) {
+	return n <= length(heap) && addr <= length(heap) - n;
+}
+
+// appends n zeroed bytes, unless that would take the heap past HEAP_SIZE
+bool heap_grow(Heap &heap, size_t n) {
+	if (n > HEAP_SIZE - length(heap)) return false;
+#ifdef KERNEL
+	for (size_t i = 0; i < n; ++i) heap.buffer[heap.len + i] = 0;
+	heap.len += n;
+#else
+	heap.resize(heap.size() + n);
+#endif
+	return true;
+}
+
+// cells are stored unaligned, at any byte address
+number_t heap_load(const uint8_t *at) {
+	number_t x;
+	memcpy(&x, at, sizeof(x));
+	return x;
+}
+void heap_store(uint8_t *at, number_t x) {
+	memcpy(at, &x, sizeof(x));
+}
+
+// the ranges may overlap
+void heap_move(uint8_t *to, const uint8_t *from, size_t n) {
+#ifdef KERNEL
+	if (to < from) {
+		for (size_t i = 0; i < n; ++i) to[i] = from[i];
+	} else {
+		while (n --> 0) to[n] = from[n];
+	}
+#else
+	memmove(to, from, n);
+#endif
+}
+
+void heap_fill(uint8_t *at, size_t n, uint8_t byte) {
+#ifdef KERNEL
+	for (size_t i = 0; i < n; ++i) at[i] = byte;
+#else
+	memset(at, byte, n);
+#endif
+}
+
+}
+
 /*** SECTION: Primitives Array ***/
 
 const char *guide_text =
@@ -285,38 +1194,51 @@ const char *guide_text =
 #define check_stack_cap(fun, expr) do {} while (0)
 #endif
 #define check_code_len(fun, len) if (length(state.code) + (len) > CODE_BUFFER_SIZE) error_fun(fun, "not enough space to generate code for user word")
+// the same for the compile functions of syntax items, which fail by returning nothing
+#ifdef KERNEL
+#define check_compile_code_len(fun, len) if (length(interpreter.state.code) + (len) > CODE_BUFFER_SIZE) { \
+		interpreter.state.error = "Error in `" fun "`: not enough space to generate code for user word"; \
+		interpreter.state.error_handled = false; \
+		return {}; \
+	}
+#else
+#define check_compile_code_len(fun, len) do {} while (0)
+#endif
 using pstate_t = ProgramState;
 const Primitive primitives[PW_COUNT] = {
 	/* STACK OPERATIONS */
 	[PW_ShowStack] = { ".", "-- ; shows the top 16 elements of the stack", [](pstate_t &state) {
-		if (length(state.stack) == 0) { writestringl("empty."); return; }
+		if (length(state.stack) == 0) { writestringl(state, "empty."); return; }
 
 		const size_t amt = length(state.stack) < 16
 			? length(state.stack)
 			: 16;
 		if (length(state.stack) > 16) {
-			writestring("... ");
+			writestring(state, "... ");
 		}
 		size_t i = amt;
 		while (i --> 0) {
 		#ifdef KERNEL
 			printf("%d ", stack_peek(state.stack, i).sign);
 		#else
-			std::cout << stack_peek(state.stack, i).sign << " ";
+			writenum_signed(state, stack_peek(state.stack, i).sign);
+			writechar(state, ' ');
 		#endif
 		}
-		writechar('\n');
+		writechar(state, '\n');
 	} },
 	[PW_StackLen] = { "stack_len", "-- a ; pushes length of stack", [](pstate_t &state) {
 		check_stack_cap("stack_len", 1);
 		push(state.stack, {
 			.pos = length(state.stack)
 		});
+		note_stack_depth(state);
 	} },
 	[PW_Dup] = { "dup", "a -- a a", [](pstate_t &state) {
 		check_stack_len_ge("dup", 1);
 		check_stack_cap("dup", 1);
 		push(state.stack, stack_peek(state.stack));
+		note_stack_depth(state);
 	} },
 	[PW_Swap] = { "swap", "a b -- b a", [](pstate_t &state) {
 		check_stack_len_ge("swap", 2);
@@ -376,6 +1298,7 @@ const Primitive primitives[PW_COUNT] = {
 			error_fun("nth", "n must be nonzero");
 		}
 		push(state.stack, stack_peek(state.stack, n-1));
+		note_stack_depth(state);
 	} },
 
 	/* ARYTHMETIC OPERATIONS */
@@ -471,10 +1394,12 @@ const Primitive primitives[PW_COUNT] = {
 	[PW_True] = { "true", "-- -1", [](pstate_t &state) {
 		check_stack_cap("true", 1);
 		push(state.stack, { .sign = -1 });
+		note_stack_depth(state);
 	} },
 	[PW_False] = { "false", "-- 0", [](pstate_t &state) {
 		check_stack_cap("false", 1);
 		push(state.stack, { .sign = 0 });
+		note_stack_depth(state);
 	} },
 
 	/* OUTPUT OPERATIONS */
@@ -484,7 +1409,8 @@ const Primitive primitives[PW_COUNT] = {
 	#ifdef KERNEL
 		printf("%d ", top.sign);
 	#else
-		std::cout << top.sign << " ";
+		writenum_signed(state, top.sign);
+		writechar(state, ' ');
 	#endif
 	} },
 	[PW_Pstr] = { "pstr", "a -- ; prints top element as string of at most four characters", [](pstate_t &state) {
@@ -494,7 +1420,7 @@ const Primitive primitives[PW_COUNT] = {
 		constexpr size_t substr_max_width = sizeof(size_t);
 		for (size_t i = 0; i < substr_max_width; ++i) {
 			if (str[i] == 0) break;
-			writechar(str[i]);
+			writechar(state, str[i]);
 		}
 	} },
 
@@ -504,7 +1430,7 @@ const Primitive primitives[PW_COUNT] = {
 		const size_t n = pop(state.stack).pos;
 
 		check_stack_len_ge("print_string", n);
-		writestring((const char*)&stack_peek(state.stack, n-1));
+		writestring(state, (const char*)&stack_peek(state.stack, n-1));
 		for (size_t i = 0; i < n; ++i) pop(state.stack);
 	} },
 
@@ -516,27 +1442,524 @@ const Primitive primitives[PW_COUNT] = {
 	/* DOCUMENTATION / HELP / INSPECTION */
 	[PW_Syntax] = { "syntax", "-- ; prints a list of all available syntax items", [](pstate_t &state) {
 		for (idx_t i = 0; i < SC_COUNT; ++i) {
-			if (i) writechar(' ');
-			writestring(state.syntax[i].name);
+			if (i) writechar(state, ' ');
+			writestring(state, state.syntax[i].name);
 		}
-		writechar('\n');
+		writechar(state, '\n');
 	} },
 	[PW_Primitives] = { "primitives", "-- ; prints a list of all available primitive words", [](pstate_t &state) {
 		for (idx_t i = 0; i < state.primitives_len; ++i) {
-			if (i) writechar(' ');
-			writestring(state.primitives[i].name);
+			if (i) writechar(state, ' ');
+			writestring(state, state.primitives[i].name);
 		}
-		writechar('\n');
+		writechar(state, '\n');
 	} },
 	[PW_Words] = { "words", "-- ; prints a list of all user-defined words", [](pstate_t &state) {
 		size_t i = length(state.words);
 		while (i --> 0) {
-			writestring(state.words[i].name);
-			if (i) writechar(' ');
+			writestring(state, state.words[i].name);
+			if (i) writechar(state, ' ');
 		}
-		writechar('\n');
+		writechar(state, '\n');
 	} },
 	[PW_Guide] = { "guide", "-- ; prints usage guide for the mieliepit interpreter", guide_primitive_fn },
+
+	/* TRACING */
+	[PW_Trace] = { "trace", "a -- ; turns execution tracing on if a is nonzero, off otherwise", [](pstate_t &state) {
+		check_stack_len_ge("trace", 1);
+		if (!trace_enable(state, pop(state.stack).pos != 0)) error_fun("trace", "could not allocate the trace ring");
+	} },
+	[PW_TraceShow] = { "trace_show", "n -- ; prints the last n traced steps", [](pstate_t &state) {
+		check_stack_len_ge("trace_show", 1);
+		trace_show(state, pop(state.stack).pos);
+	} },
+
+	/* PROFILING */
+#ifdef MIELIEPIT_PROFILE
+	[PW_Profile] = { "profile", "a -- ; turns the profiler on if a is nonzero, off otherwise", [](pstate_t &state) {
+		check_stack_len_ge("profile", 1);
+		const bool enable = pop(state.stack).pos != 0;
+		if (enable != state.profile.enabled) profile_clear_frames(state.profile);
+		state.profile.enabled = enable;
+	} },
+	[PW_ProfileReset] = { "profile_reset", "-- ; clears all collected profiling data", [](pstate_t &state) {
+		profile_reset(state.profile);
+	} },
+	[PW_ProfileReport] = { "profile_report", "-- ; prints call counts and times per word and primitive, hottest first", [](pstate_t &state) {
+		profile_report(state);
+	} },
+	[PW_ProfilePerf] = { "profile_perf", "a -- ; also collects hardware counters per word while profiling if a is nonzero", [](pstate_t &state) {
+		check_stack_len_ge("profile_perf", 1);
+		const bool enable = pop(state.stack).pos != 0;
+		if (enable && !perf_open()) {
+			writestring(state, "profile_perf: hardware counters unavailable: ");
+			writestringl(state, perf_error());
+			return;
+		}
+		// counts of calls that are already running would be meaningless
+		profile_clear_frames(state.profile);
+		state.profile.perf = enable;
+	} },
+#else
+	[PW_Profile] = { "profile", "a -- ; turns the profiler on if a is nonzero, off otherwise", [](pstate_t &state) {
+		error_fun("profile", "profiling support not compiled in (build with -DMIELIEPIT_PROFILE)");
+	} },
+	[PW_ProfileReset] = { "profile_reset", "-- ; clears all collected profiling data", [](pstate_t &state) {
+		error_fun("profile_reset", "profiling support not compiled in (build with -DMIELIEPIT_PROFILE)");
+	} },
+	[PW_ProfileReport] = { "profile_report", "-- ; prints call counts and times per word and primitive, hottest first", [](pstate_t &state) {
+		error_fun("profile_report", "profiling support not compiled in (build with -DMIELIEPIT_PROFILE)");
+	} },
+	[PW_ProfilePerf] = { "profile_perf", "a -- ; also collects hardware counters per word while profiling if a is nonzero", [](pstate_t &state) {
+		error_fun("profile_perf", "profiling support not compiled in (build with -DMIELIEPIT_PROFILE)");
+	} },
+#endif
+
+	/* INTROSPECTION */
+	[PW_MemStats] = { "mem_stats", "-- ; prints how full the stack, code and word buffers are", [](pstate_t &state) {
+		print_mem_stats(state, mem_stats(state));
+	} },
+
+	/* IMAGES */
+	[PW_SaveImage] = { "save_image", "... n -- ; saves all words to the image file named by the string ... n", [](pstate_t &state) {
+		check_stack_len_ge("save_image", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("save_image", n);
+	#ifdef KERNEL
+		for (size_t i = 0; i < n; ++i) pop(state.stack);
+		error_fun("save_image", "images are not supported in the kernel");
+	#else
+		std::string path((const char*)&stack_peek(state.stack, n-1), n * sizeof(number_t));
+		path.resize(strnlen(path.c_str(), path.size()));
+		for (size_t i = 0; i < n; ++i) pop(state.stack);
+
+		if (!save_image(state, path.c_str())) error_fun("save_image", "could not write the image");
+	#endif
+	} },
+
+	/* INPUT */
+	[PW_ReadNum] = { "read_num", "fd -- n true | false ; reads the next number from a file descriptor (0 for stdin), false at the end", [](pstate_t &state) {
+		check_stack_len_ge("read_num", 1);
+	#ifdef KERNEL
+		pop(state.stack);
+		error_fun("read_num", "reading input is not supported in the kernel");
+	#else
+		const int fd = pop(state.stack).sign;
+		number_t n;
+		const ReadNumbers res = read_numbers(state, fd, &n, 1);
+		if (res.status == ReadNumbers::TooLarge) error_fun("read_num", "number has more than 20 digits or overflows");
+		if (res.status == ReadNumbers::Failed) error_fun("read_num", "could not read from the file descriptor");
+		if (res.count) push(state.stack, n);
+		push(state.stack, { .sign = res.count ? -1 : 0 });
+		note_stack_depth(state);
+	#endif
+	} },
+	[PW_ReadNums] = { "read_nums", "fd n -- a1 ... ak k ; reads up to n numbers from a file descriptor, fewer only at the end", [](pstate_t &state) {
+		check_stack_len_ge("read_nums", 2);
+	#ifdef KERNEL
+		pop(state.stack);
+		pop(state.stack);
+		error_fun("read_nums", "reading input is not supported in the kernel");
+	#else
+		const size_t n = pop(state.stack).pos;
+		const int fd = pop(state.stack).sign;
+
+		// read straight into the stack, a chunk at a time so a huge n doesn't allocate up front
+		constexpr size_t chunk = 1 << 16;
+		const size_t start = length(state.stack);
+		size_t count = 0;
+		while (count < n) {
+			const size_t want = std::min(n - count, chunk);
+			state.stack.resize(start + count + want);
+			const ReadNumbers res = read_numbers(state, fd, &state.stack[start + count], want);
+			count += res.count;
+			state.stack.resize(start + count);
+			if (res.status == ReadNumbers::TooLarge) error_fun("read_nums", "number has more than 20 digits or overflows");
+			if (res.status == ReadNumbers::Failed) error_fun("read_nums", "could not read from the file descriptor");
+			if (res.count < want) break;
+		}
+		push(state.stack, { .pos = count });
+		note_stack_depth(state);
+	#endif
+	} },
+	[PW_LoadCells] = { "load_cells", "... n -- a1 ... ak k ; pushes the cells of the binary file named by the string ... n", [](pstate_t &state) {
+		check_stack_len_ge("load_cells", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("load_cells", n);
+	#ifdef KERNEL
+		for (size_t i = 0; i < n; ++i) pop(state.stack);
+		error_fun("load_cells", "files are not supported in the kernel");
+	#else
+		std::string path((const char*)&stack_peek(state.stack, n-1), n * sizeof(number_t));
+		path.resize(strnlen(path.c_str(), path.size()));
+		for (size_t i = 0; i < n; ++i) pop(state.stack);
+
+		size_t count;
+		if (!load_cells(state.stack, path.c_str(), count)) error_fun("load_cells", "could not load the file as cells");
+		push(state.stack, { .pos = count });
+		note_stack_depth(state);
+	#endif
+	} },
+	[PW_DumpCells] = { "dump_cells", "a1 ... ak k ... n -- ; writes a1 ... ak as binary cells to the file named by the string ... n", [](pstate_t &state) {
+		check_stack_len_ge("dump_cells", 1);
+		const size_t n = pop(state.stack).pos;
+		// compared without adding them up, which would wrap around for huge counts
+		if (n >= length(state.stack)) error_fun("dump_cells", "stack length should be >= n + 1");
+		const size_t k = stack_peek(state.stack, n).pos;
+		if (k > length(state.stack) - n - 1) error_fun("dump_cells", "stack length should be >= n + 1 + k");
+	#ifdef KERNEL
+		for (size_t i = 0; i < n + 1 + k; ++i) pop(state.stack);
+		error_fun("dump_cells", "files are not supported in the kernel");
+	#else
+		std::string path((const char*)&stack_peek(state.stack, n-1), n * sizeof(number_t));
+		path.resize(strnlen(path.c_str(), path.size()));
+		const size_t start = length(state.stack) - n - 1 - k;
+		const bool ok = dump_cells(&state.stack[start], k, path.c_str());
+		state.stack.resize(start);
+
+		if (!ok) error_fun("dump_cells", "could not write the file");
+	#endif
+	} },
+
+	/* RANGE OPERATIONS */
+	[PW_SumN] = { "sum_n", "a1 ... an n -- s ; sums the top n elements (0 for none)", [](pstate_t &state) {
+		check_stack_len_ge("sum_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("sum_n", n);
+		const number_t res = range_sum(stack_top_n(state.stack, n), n);
+		drop_n(state.stack, n);
+		push(state.stack, res);
+	} },
+	[PW_ProdN] = { "prod_n", "a1 ... an n -- p ; multiplies the top n elements (1 for none)", [](pstate_t &state) {
+		check_stack_len_ge("prod_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("prod_n", n);
+		const number_t res = range_prod(stack_top_n(state.stack, n), n);
+		drop_n(state.stack, n);
+		push(state.stack, res);
+	} },
+	[PW_MinN] = { "min_n", "a1 ... an n -- m ; the smallest of the top n elements", [](pstate_t &state) {
+		check_stack_len_ge("min_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("min_n", n);
+		if (n == 0) {
+			error_fun("min_n", "n must be nonzero");
+		}
+		const number_t res = range_min(stack_top_n(state.stack, n), n);
+		drop_n(state.stack, n);
+		push(state.stack, res);
+	} },
+	[PW_MaxN] = { "max_n", "a1 ... an n -- m ; the largest of the top n elements", [](pstate_t &state) {
+		check_stack_len_ge("max_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("max_n", n);
+		if (n == 0) {
+			error_fun("max_n", "n must be nonzero");
+		}
+		const number_t res = range_max(stack_top_n(state.stack, n), n);
+		drop_n(state.stack, n);
+		push(state.stack, res);
+	} },
+	[PW_AndN] = { "and_n", "a1 ... an n -- a1&...&an ; ands the top n elements (-1 for none)", [](pstate_t &state) {
+		check_stack_len_ge("and_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("and_n", n);
+		const number_t res = range_and(stack_top_n(state.stack, n), n);
+		drop_n(state.stack, n);
+		push(state.stack, res);
+	} },
+	[PW_OrN] = { "or_n", "a1 ... an n -- a1|...|an ; ors the top n elements (0 for none)", [](pstate_t &state) {
+		check_stack_len_ge("or_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("or_n", n);
+		const number_t res = range_or(stack_top_n(state.stack, n), n);
+		drop_n(state.stack, n);
+		push(state.stack, res);
+	} },
+	[PW_XorN] = { "xor_n", "a1 ... an n -- a1^...^an ; xors the top n elements (0 for none)", [](pstate_t &state) {
+		check_stack_len_ge("xor_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("xor_n", n);
+		const number_t res = range_xor(stack_top_n(state.stack, n), n);
+		drop_n(state.stack, n);
+		push(state.stack, res);
+	} },
+	[PW_CountEqN] = { "count_eq_n", "a1 ... an n x -- k ; counts the top n elements (under x) equal to x", [](pstate_t &state) {
+		check_stack_len_ge("count_eq_n", 2);
+		const number_t x = pop(state.stack);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("count_eq_n", n);
+		const size_t res = range_count_eq(stack_top_n(state.stack, n), n, x);
+		drop_n(state.stack, n);
+		push(state.stack, { .pos = res });
+	} },
+	[PW_AddN] = { "add_n", "a1 ... an n x -- a1+x ... an+x n ; adds x to each of the n elements under it", [](pstate_t &state) {
+		check_stack_len_ge("add_n", 2);
+		const number_t x = pop(state.stack);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("add_n", n);
+		map_range<AddOp>(stack_top_n(state.stack, n), nullptr, n, x);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_SubN] = { "sub_n", "a1 ... an n x -- a1-x ... an-x n ; subtracts x from each of the n elements under it", [](pstate_t &state) {
+		check_stack_len_ge("sub_n", 2);
+		const number_t x = pop(state.stack);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("sub_n", n);
+		map_range<SubOp>(stack_top_n(state.stack, n), nullptr, n, x);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_MulN] = { "mul_n", "a1 ... an n x -- a1*x ... an*x n ; multiplies each of the n elements under x by it", [](pstate_t &state) {
+		check_stack_len_ge("mul_n", 2);
+		const number_t x = pop(state.stack);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("mul_n", n);
+		map_range<MulOp>(stack_top_n(state.stack, n), nullptr, n, x);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_ShlN] = { "shl_n", "a1 ... an n x -- a1<<x ... an<<x n ; shifts each of the n elements under x left by it", [](pstate_t &state) {
+		check_stack_len_ge("shl_n", 2);
+		number_t x = pop(state.stack);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("shl_n", n);
+		// like shl and shr, 32 or more shifts everything out
+		if (x.pos >= 32) x.pos = 64;
+		map_range<ShlOp>(stack_top_n(state.stack, n), nullptr, n, x);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_ShrN] = { "shr_n", "a1 ... an n x -- a1>>x ... an>>x n ; shifts each of the n elements under x right by it", [](pstate_t &state) {
+		check_stack_len_ge("shr_n", 2);
+		number_t x = pop(state.stack);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("shr_n", n);
+		// like shl and shr, 32 or more shifts everything out
+		if (x.pos >= 32) x.pos = 64;
+		map_range<ShrOp>(stack_top_n(state.stack, n), nullptr, n, x);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_CmpEqN] = { "cmp_eq_n", "a1 ... an n x -- a1=x ... an=x n ; compares each of the n elements under x with it (-1 or 0)", [](pstate_t &state) {
+		check_stack_len_ge("cmp_eq_n", 2);
+		const number_t x = pop(state.stack);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("cmp_eq_n", n);
+		map_range<EqOp>(stack_top_n(state.stack, n), nullptr, n, x);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_CmpLtN] = { "cmp_lt_n", "a1 ... an n x -- a1<x ... an<x n ; whether each of the n elements under x is less than it (-1 or 0)", [](pstate_t &state) {
+		check_stack_len_ge("cmp_lt_n", 2);
+		const number_t x = pop(state.stack);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("cmp_lt_n", n);
+		map_range<LtOp>(stack_top_n(state.stack, n), nullptr, n, x);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_AddNN] = { "add_nn", "a1 ... an b1 ... bn n -- a1+b1 ... an+bn n ; adds two ranges of n elements", [](pstate_t &state) {
+		check_stack_len_ge("add_nn", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("add_nn", n);
+		check_stack_len_ge("add_nn", 2 * n);
+		number_t *a = stack_top_n(state.stack, 2 * n);
+		map_range<AddOp>(a, a + n, n, {});
+		drop_n(state.stack, n);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_SubNN] = { "sub_nn", "a1 ... an b1 ... bn n -- a1-b1 ... an-bn n ; subtracts two ranges of n elements", [](pstate_t &state) {
+		check_stack_len_ge("sub_nn", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("sub_nn", n);
+		check_stack_len_ge("sub_nn", 2 * n);
+		number_t *a = stack_top_n(state.stack, 2 * n);
+		map_range<SubOp>(a, a + n, n, {});
+		drop_n(state.stack, n);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_MulNN] = { "mul_nn", "a1 ... an b1 ... bn n -- a1*b1 ... an*bn n ; multiplies two ranges of n elements", [](pstate_t &state) {
+		check_stack_len_ge("mul_nn", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("mul_nn", n);
+		check_stack_len_ge("mul_nn", 2 * n);
+		number_t *a = stack_top_n(state.stack, 2 * n);
+		map_range<MulOp>(a, a + n, n, {});
+		drop_n(state.stack, n);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_CmpEqNN] = { "cmp_eq_nn", "a1 ... an b1 ... bn n -- a1=b1 ... an=bn n ; compares two ranges of n elements (-1 or 0)", [](pstate_t &state) {
+		check_stack_len_ge("cmp_eq_nn", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("cmp_eq_nn", n);
+		check_stack_len_ge("cmp_eq_nn", 2 * n);
+		number_t *a = stack_top_n(state.stack, 2 * n);
+		map_range<EqOp>(a, a + n, n, {});
+		drop_n(state.stack, n);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_CmpLtNN] = { "cmp_lt_nn", "a1 ... an b1 ... bn n -- a1<b1 ... an<bn n ; whether each element of the first range of n is less than the second's (-1 or 0)", [](pstate_t &state) {
+		check_stack_len_ge("cmp_lt_nn", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("cmp_lt_nn", n);
+		check_stack_len_ge("cmp_lt_nn", 2 * n);
+		number_t *a = stack_top_n(state.stack, 2 * n);
+		map_range<LtOp>(a, a + n, n, {});
+		drop_n(state.stack, n);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_SortN] = { "sort_n", "a1 ... an n -- s1 ... sn n ; sorts the top n elements, smallest deepest", [](pstate_t &state) {
+		check_stack_len_ge("sort_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("sort_n", n);
+		sort_range<false>(stack_top_n(state.stack, n), n);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_ReverseSortN] = { "reverse_sort_n", "a1 ... an n -- s1 ... sn n ; sorts the top n elements, largest deepest", [](pstate_t &state) {
+		check_stack_len_ge("reverse_sort_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("reverse_sort_n", n);
+		sort_range<true>(stack_top_n(state.stack, n), n);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_BsearchN] = { "bsearch_n", "s1 ... sn n x -- s1 ... sn n i ; the index of x in the n elements under it, sorted by sort_n (0 for s1), or -1", [](pstate_t &state) {
+		check_stack_len_ge("bsearch_n", 2);
+		const number_t x = pop(state.stack);
+		const size_t n = stack_peek(state.stack).pos;
+		check_stack_len_ge("bsearch_n", n);
+		check_stack_len_ge("bsearch_n", n + 1);
+		push(state.stack, bsearch_range(stack_top_n(state.stack, n + 1), n, x));
+	} },
+	[PW_UniqN] = { "uniq_n", "a1 ... an n -- b1 ... bk k ; drops every one of the top n elements equal to the one before it", [](pstate_t &state) {
+		check_stack_len_ge("uniq_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("uniq_n", n);
+		const size_t k = uniq_range(stack_top_n(state.stack, n), n);
+		drop_n(state.stack, n - k);
+		push(state.stack, { .pos = k });
+	} },
+	[PW_ScanN] = { "scan_n", "a1 ... an n -- a1 a1+a2 ... a1+...+an n ; replaces the top n elements with their running sums", [](pstate_t &state) {
+		check_stack_len_ge("scan_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("scan_n", n);
+		scan_range(stack_top_n(state.stack, n), n);
+		push(state.stack, { .pos = n });
+	} },
+	[PW_HistN] = { "hist_n", "a1 ... an n lo width bins -- c1 ... cbins bins ; counts the top n elements into bins lo, lo+width, ... (leaving out the rest)", [](pstate_t &state) {
+		check_stack_len_ge("hist_n", 4);
+		const size_t bins = pop(state.stack).pos;
+		const size_t width = pop(state.stack).pos;
+		const number_t lo = pop(state.stack);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("hist_n", n);
+		if (width == 0) {
+			error_fun("hist_n", "width must be nonzero");
+		}
+		if (bins > ((size_t)1 << 24)) {
+			error_fun("hist_n", "bins must be at most 16777216");
+		}
+		check_stack_cap("hist_n", bins);
+
+		// count into cells above the range, then move them down over it
+		for (size_t i = 0; i < bins; ++i) push(state.stack, { .pos = 0 });
+		note_stack_depth(state);
+		number_t *cells = stack_top_n(state.stack, n + bins);
+		number_t *counts = cells + n;
+		size_t shift = 0;
+		while (shift < 63 && ((size_t)1 << shift) < width) ++shift;
+		const bool pow2 = ((size_t)1 << shift) == width;
+		for (size_t i = 0; i < n; ++i) {
+			if (cells[i].sign < lo.sign) continue;
+			const size_t offset = cells[i].pos - lo.pos;
+			const size_t bin = pow2 ? offset >> shift : offset / width;
+			if (bin < bins) ++counts[bin].pos;
+		}
+		for (size_t i = 0; i < bins; ++i) cells[i] = counts[i];
+		drop_n(state.stack, n);
+		push(state.stack, { .pos = bins });
+	} },
+	[PW_CompactN] = { "compact_n", "a1 ... an f1 ... fn n -- b1 ... bk k ; keeps the elements of the first range of n whose flag in the second is nonzero", [](pstate_t &state) {
+		check_stack_len_ge("compact_n", 1);
+		const size_t n = pop(state.stack).pos;
+		check_stack_len_ge("compact_n", n);
+		check_stack_len_ge("compact_n", 2 * n);
+		number_t *cells = stack_top_n(state.stack, 2 * n);
+		const size_t k = compact_range(cells, cells + n, n);
+		drop_n(state.stack, 2 * n - k);
+		push(state.stack, { .pos = k });
+	} },
+
+	/* MEMORY */
+	[PW_Allot] = { "allot", "n -- a ; reserves n zeroed bytes of memory and pushes the address of the first (0 allot gives the end)", [](pstate_t &state) {
+		check_stack_len_ge("allot", 1);
+		const size_t n = stack_peek(state.stack).pos;
+		const size_t addr = length(state.heap);
+		if (!heap_grow(state.heap, n)) {
+			error_fun("allot", "not enough memory left");
+		}
+		stack_peek(state.stack).pos = addr;
+	} },
+	[PW_Fetch] = { "@", "a -- x ; the cell stored at address a", [](pstate_t &state) {
+		check_stack_len_ge("@", 1);
+		number_t &a = stack_peek(state.stack);
+		if (!heap_in_bounds(state.heap, a.pos, sizeof(number_t))) {
+			error_fun("@", "address out of bounds");
+		}
+		a = heap_load(heap_data(state.heap) + a.pos);
+	} },
+	[PW_Store] = { "!", "x a -- ; stores the cell x at address a", [](pstate_t &state) {
+		check_stack_len_ge("!", 2);
+		const size_t a = stack_peek(state.stack).pos;
+		if (!heap_in_bounds(state.heap, a, sizeof(number_t))) {
+			error_fun("!", "address out of bounds");
+		}
+		heap_store(heap_data(state.heap) + a, stack_peek(state.stack, 1));
+		drop_n(state.stack, 2);
+	} },
+	[PW_CFetch] = { "c@", "a -- c ; the byte stored at address a", [](pstate_t &state) {
+		check_stack_len_ge("c@", 1);
+		number_t &a = stack_peek(state.stack);
+		if (!heap_in_bounds(state.heap, a.pos, 1)) {
+			error_fun("c@", "address out of bounds");
+		}
+		a.pos = heap_data(state.heap)[a.pos];
+	} },
+	[PW_CStore] = { "c!", "c a -- ; stores the low byte of c at address a", [](pstate_t &state) {
+		check_stack_len_ge("c!", 2);
+		const size_t a = stack_peek(state.stack).pos;
+		if (!heap_in_bounds(state.heap, a, 1)) {
+			error_fun("c!", "address out of bounds");
+		}
+		heap_data(state.heap)[a] = stack_peek(state.stack, 1).pos;
+		drop_n(state.stack, 2);
+	} },
+	[PW_AddStore] = { "+!", "n a -- ; adds n to the cell at address a", [](pstate_t &state) {
+		check_stack_len_ge("+!", 2);
+		const size_t a = stack_peek(state.stack).pos;
+		if (!heap_in_bounds(state.heap, a, sizeof(number_t))) {
+			error_fun("+!", "address out of bounds");
+		}
+		uint8_t *at = heap_data(state.heap) + a;
+		heap_store(at, { .pos = heap_load(at).pos + stack_peek(state.stack, 1).pos });
+		drop_n(state.stack, 2);
+	} },
+	[PW_Move] = { "move", "a b n -- ; copies n bytes from address a to address b (the two may overlap)", [](pstate_t &state) {
+		check_stack_len_ge("move", 3);
+		const size_t n = stack_peek(state.stack).pos;
+		const size_t to = stack_peek(state.stack, 1).pos;
+		const size_t from = stack_peek(state.stack, 2).pos;
+		if (!heap_in_bounds(state.heap, from, n) || !heap_in_bounds(state.heap, to, n)) {
+			error_fun("move", "address out of bounds");
+		}
+		heap_move(heap_data(state.heap) + to, heap_data(state.heap) + from, n);
+		drop_n(state.stack, 3);
+	} },
+	[PW_Fill] = { "fill", "a n c -- ; sets the n bytes from address a to the low byte of c", [](pstate_t &state) {
+		check_stack_len_ge("fill", 3);
+		const uint8_t byte = stack_peek(state.stack).pos;
+		const size_t n = stack_peek(state.stack, 1).pos;
+		const size_t a = stack_peek(state.stack, 2).pos;
+		if (!heap_in_bounds(state.heap, a, n)) {
+			error_fun("fill", "address out of bounds");
+		}
+		heap_fill(heap_data(state.heap) + a, n, byte);
+		drop_n(state.stack, 3);
+	} },
 };
 
 #undef error_fun
@@ -624,6 +2047,7 @@ void interpret_string(Interpreter &interpreter) {
 		push(interpreter.state.stack, { .pos = num });
 	}
 	push(interpreter.state.stack, { .pos = str.words });
+	note_stack_depth(interpreter.state);
 }
 
 void ignore_string(Interpreter &interpreter) {
@@ -705,6 +2129,7 @@ void interpret_hex(Interpreter &interpreter) {
 	// TODO:
 	// check_stack_cap("\"", 1);
 	push(interpreter.state.stack, num);
+	note_stack_depth(interpreter.state);
 }
 
 void ignore_hex(Interpreter &interpreter) {
@@ -764,6 +2189,7 @@ void interpret_short_str(Interpreter &interpreter) {
 	// TODO:
 	// check_stack_cap("\"", 1);
 	push(interpreter.state.stack, str);
+	note_stack_depth(interpreter.state);
 }
 
 void ignore_short_str(Interpreter &interpreter) {
@@ -808,7 +2234,10 @@ void interpret_help(Interpreter &interpreter) {
 		#ifdef KERNEL
 			printf("`%s`: %s", word.name, word.desc);
 		#else
-			std::cout << '`' << word.name << "`: " << word.desc;
+			writechar(interpreter.state, '`');
+			writestring(interpreter.state, word.name);
+			writestring(interpreter.state, "`: ");
+			writestring(interpreter.state, word.desc);
 		#endif
 		} break;
 		case Value::Primitive: {
@@ -816,7 +2245,10 @@ void interpret_help(Interpreter &interpreter) {
 		#ifdef KERNEL
 			printf("`%s`: %s", primitive.name, primitive.desc);
 		#else
-			std::cout << '`' << primitive.name << "`: " << primitive.desc;
+			writechar(interpreter.state, '`');
+			writestring(interpreter.state, primitive.name);
+			writestring(interpreter.state, "`: ");
+			writestring(interpreter.state, primitive.desc);
 		#endif
 		} break;
 		case Value::Syntax: {
@@ -824,14 +2256,19 @@ void interpret_help(Interpreter &interpreter) {
 		#ifdef KERNEL
 			printf("`%s`: %s", syntax.name, syntax.desc);
 		#else
-			std::cout << '`' << syntax.name << "`: " << syntax.desc;
+			writechar(interpreter.state, '`');
+			writestring(interpreter.state, syntax.name);
+			writestring(interpreter.state, "`: ");
+			writestring(interpreter.state, syntax.desc);
 		#endif
 		} break;
 		case Value::Number: {
 		#ifdef KERNEL
 			printf("Pushes the number %u to the stack", get(val).number.pos);
 		#else
-			std::cout << "Pushes the number " << get(val).number.pos << " to the stack";
+			writestring(interpreter.state, "Pushes the number ");
+			writenum_padded(interpreter.state, get(val).number.pos, 0);
+			writestring(interpreter.state, " to the stack");
 		#endif
 		} break;
 		case Value::RawFunction: {
@@ -853,7 +2290,49 @@ void ignore_help(Interpreter &interpreter) {
 	}
 }
 
-extern RawFunction print_raw;
+// fixed strings printed by compiled `help` and `def`; compiled code refers to
+// them (and to names and descriptions) by index, so that it contains no pointers
+enum StaticString {
+	SS_HelpSeparator,
+	SS_PushesNumber,
+	SS_ToTheStack,
+	SS_DefEnd,
+	SS_DefPrimitive,
+	SS_DefSyntax,
+	SS_DefLiteral,
+
+	SS_COUNT,
+};
+const char *const static_strings[SS_COUNT] = {
+	[SS_HelpSeparator] = "`: ",
+	[SS_PushesNumber] = "Pushes the number ",
+	[SS_ToTheStack] = " to the stack",
+	[SS_DefEnd] = "`>",
+	[SS_DefPrimitive] = "<built-in primitive `",
+	[SS_DefSyntax] = "<built-in syntax expression `",
+	[SS_DefLiteral] = "<literal ",
+};
+
+extern RawFunction print_static;
+extern RawFunction print_name;
+extern RawFunction print_desc;
+
+void compile_print_static(ProgramState &state, StaticString str) {
+	push(state.code, Value::new_number({ .pos = str }));
+	push(state.code, Value::new_function_ptr(&print_static));
+}
+// the name or description of the word, primitive or syntax item of the given type and index
+void compile_print_name(ProgramState &state, Value::Type type, idx_t idx) {
+	push(state.code, Value::new_number({ .pos = type }));
+	push(state.code, Value::new_number({ .pos = idx }));
+	push(state.code, Value::new_function_ptr(&print_name));
+}
+void compile_print_desc(ProgramState &state, Value::Type type, idx_t idx) {
+	push(state.code, Value::new_number({ .pos = type }));
+	push(state.code, Value::new_number({ .pos = idx }));
+	push(state.code, Value::new_function_ptr(&print_desc));
+}
+
 maybe_t<size_t> compile_help(Interpreter &interpreter) {
 	interpreter.get_word();
 
@@ -873,100 +2352,41 @@ maybe_t<size_t> compile_help(Interpreter &interpreter) {
 		// error_fun("help", "Couldn't find specified word");
 		interpreter.state.error = "Error: couldn't find the specified word";
 		interpreter.state.error_handled = false;
-		return {};
-	}
-
-	const char *s1 = "`: ";
-	const char *s2 = "Pushes the number ";
-	const char *s3 = " to the stack";
-
-	switch (get(val).type) {
-		case Value::Word: {
-			// TODO:
-			// check_code_len("help", 15);
-			const auto &word = interpreter.state.words[get(val).word_idx];
+		return {};
+	}
 
-			push(interpreter.state.code, Value::new_number({
-				.pos = '`'
-			}));
-			push(interpreter.state.code, Value::new_primitive(PW_Pstr));
+	// the most any case below compiles
+	check_compile_code_len("help", 11);
 
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(word.name)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+	// `name`: desc
+	auto compile_name_and_desc = [&](Value::Type type, idx_t idx) {
+		push(interpreter.state.code, Value::new_number({
+			.pos = '`'
+		}));
+		push(interpreter.state.code, Value::new_primitive(PW_Pstr));
 
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s1)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+		compile_print_name(interpreter.state, type, idx);
+		compile_print_static(interpreter.state, SS_HelpSeparator);
+		compile_print_desc(interpreter.state, type, idx);
+	};
 
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(word.desc)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+	switch (get(val).type) {
+		case Value::Word: {
+			compile_name_and_desc(Value::Word, get(val).word_idx);
 		} break;
 		case Value::Primitive: {
-			// TODO:
-			// check_code_len("help", 15);
-			const auto &primitive = interpreter.state.primitives[get(val).primitive_idx];
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = '`'
-			}));
-			push(interpreter.state.code, Value::new_primitive(PW_Pstr));
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(primitive.name)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s1)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(primitive.desc)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+			compile_name_and_desc(Value::Primitive, get(val).primitive_idx);
 		} break;
 		case Value::Syntax: {
-			const auto &syntax = interpreter.state.syntax[get(val).syntax_idx];
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = '`'
-			}));
-			push(interpreter.state.code, Value::new_primitive(PW_Pstr));
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(syntax.name)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s1)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(syntax.desc)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+			compile_name_and_desc(Value::Syntax, get(val).syntax_idx);
 		} break;
 		case Value::Number: {
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s2)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+			compile_print_static(interpreter.state, SS_PushesNumber);
 
 			push(interpreter.state.code, Value::new_number(get(val).number));
 			push(interpreter.state.code, Value::new_primitive(PW_Print));
 
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s3)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+			compile_print_static(interpreter.state, SS_ToTheStack);
 		} break;
 		case Value::RawFunction: {
 			// TODO: some sort of error (maybe?)
@@ -977,6 +2397,34 @@ maybe_t<size_t> compile_help(Interpreter &interpreter) {
 	return length(interpreter.state.code) - start_len;
 }
 
+// prints a single value the way it appears in a word definition
+void print_value(const ProgramState &state, Value value) {
+	switch (value.type) {
+		case Value::Word: {
+			assert(value.word_idx < length(state.words));
+			writestring(state, state.words[value.word_idx].name);
+		} break;
+		case Value::Primitive: {
+			assert(value.primitive_idx < state.primitives_len);
+			writestring(state, state.primitives[value.primitive_idx].name);
+		} break;
+		case Value::Syntax: {
+			assert(value.syntax_idx < state.syntax_len);
+			writestring(state, state.syntax[value.syntax_idx].name);
+		} break;
+		case Value::Number: {
+		#ifdef KERNEL
+			printf("%u", value.number.pos);
+		#else
+			writenum_padded(state, value.number.pos, 0);
+		#endif
+		} break;
+		case Value::RawFunction: {
+			writestring(state, value.function_ptr->name);
+		} break;
+	}
+}
+
 void print_definition(ProgramState &state, idx_t word_idx) {
 	assert(word_idx < length(state.words));
 	const Word &word = state.words[word_idx];
@@ -984,53 +2432,29 @@ void print_definition(ProgramState &state, idx_t word_idx) {
 #ifdef KERNEL
 	printf(": %s ( %s )", word.name, word.desc);
 #else
-	std::cout << ": " << word.name << " ( " << word.desc << " )";
+	writestring(state, ": ");
+	writestring(state, word.name);
+	writestring(state, " ( ");
+	writestring(state, word.desc);
+	writestring(state, " )");
 #endif
 
 	assert(word.code_pos <= length(state.code));
 	assert(word.code_pos + word.code_len <= length(state.code));
 	for (idx_t i = word.code_pos; i < word.code_pos + word.code_len; ++i) {
 		const auto value = state.code[i];
-		switch (value.type) {
-			case Value::Word: {
-				assert(value.word_idx < length(state.words));
-			#ifdef KERNEL
-				printf(" %s", state.words[value.word_idx].name);
-			#else
-				std::cout << ' ' << state.words[value.word_idx].name;
-			#endif
-			} break;
-			case Value::Primitive: {
-				assert(value.primitive_idx < state.primitives_len);
-			#ifdef KERNEL
-				printf(" %s", state.primitives[value.primitive_idx]);
-			#else
-				std::cout << ' ' << state.primitives[value.primitive_idx].name;
-			#endif
-			} break;
-			case Value::Syntax: {
-				state.error = "Error: syntax expression shouldn't be present in compiled word";
-				state.error_handled = false;
-			} break;
-			case Value::Number: {
-			#ifdef KERNEL
-				printf(" %u", value.number.pos);
-			#else
-				std::cout << ' ' << value.number.pos;
-			#endif
-			} break;
-			case Value::RawFunction: {
-			#ifdef KERNEL
-				printf(" %s", value.function_ptr->name);
-			#else
-				std::cout << ' ' << value.function_ptr->name;
-			#endif
-			} break;
-		}
-	}
-	writestring(" ;");
+		if (value.type == Value::Syntax) {
+			state.error = "Error: syntax expression shouldn't be present in compiled word";
+			state.error_handled = false;
+			continue;
+		}
+		writechar(state, ' ');
+		print_value(state, value);
+	}
+	writestring(state, " ;");
 }
-void interpret_def(Interpreter &interpreter) {
+// reads the word after def or adef, or sets the error if there is none or it is unknown
+maybe_t<Value> read_def_operand(Interpreter &interpreter) {
 	interpreter.get_word();
 
 	if (interpreter.curr_word.len == 0) {
@@ -1038,7 +2462,7 @@ void interpret_def(Interpreter &interpreter) {
 		// error_fun("def", "expected following word");
 		interpreter.state.error = "Error: expected following word";
 		interpreter.state.error_handled = false;
-		return;
+		return {};
 	}
 
 	const maybe_t<Value> val = interpreter.read_value();
@@ -1047,8 +2471,14 @@ void interpret_def(Interpreter &interpreter) {
 		// error_fun("def", "Couldn't find specified word");
 		interpreter.state.error = "Error: couldn't find the specified word";
 		interpreter.state.error_handled = false;
-		return;
+		return {};
 	}
+	return val;
+}
+
+void interpret_def(Interpreter &interpreter) {
+	const maybe_t<Value> val = read_def_operand(interpreter);
+	if (!has(val)) return;
 
 	switch (get(val).type) {
 		case Value::Word: {
@@ -1059,7 +2489,9 @@ void interpret_def(Interpreter &interpreter) {
 		#ifdef KERNEL
 			printf("<built-in primitive `%s`>", primitive.name);
 		#else
-			std::cout << "<built-in primitive `" << primitive.name << "`>";
+			writestring(interpreter.state, "<built-in primitive `");
+			writestring(interpreter.state, primitive.name);
+			writestring(interpreter.state, "`>");
 		#endif
 		} break;
 		case Value::Syntax: {
@@ -1067,14 +2499,18 @@ void interpret_def(Interpreter &interpreter) {
 		#ifdef KERNEL
 			printf("<built-in syntax expression `%s`>", syntax.name);
 		#else
-			std::cout << "<build-in syntax expression `" << syntax.name << "`>";
+			writestring(interpreter.state, "<build-in syntax expression `");
+			writestring(interpreter.state, syntax.name);
+			writestring(interpreter.state, "`>");
 		#endif
 		} break;
 		case Value::Number: {
 		#ifdef KERNEL
 			printf("<literal %u>", get(val).number.pos);
 		#else
-			std::cout << "<literal " << get(val).number.pos << '>';
+			writestring(interpreter.state, "<literal ");
+			writenum_padded(interpreter.state, get(val).number.pos, 0);
+			writechar(interpreter.state, '>');
 		#endif
 		} break;
 		case Value::RawFunction: {
@@ -1096,33 +2532,171 @@ void ignore_def(Interpreter &interpreter) {
 	}
 }
 
-extern RawFunction print_definition_rf;
-maybe_t<size_t> compile_def(Interpreter &interpreter) {
-	interpreter.get_word();
+#ifdef MIELIEPIT_PROFILE
+extern RawFunction rep_and;
+extern RawFunction filter_rf;
+extern RawFunction time_rf;
+extern RawFunction perf_stat_rf;
+extern RawFunction tail_recurse;
 
-	const size_t start_len = length(interpreter.state.code);
+// prints a share given in tenths of a percent, eg. ` 12.5%`
+void write_permille(const ProgramState &state, uint64_t permille) {
+	writenum_padded(state, permille / 10, 4);
+	writechar(state, '.');
+	writechar(state, '0' + permille % 10);
+	writechar(state, '%');
+}
 
-	if (interpreter.curr_word.len == 0) {
-		// TODO:
-		// error_fun("def", "expected following word");
-		interpreter.state.error = "Error: expected following word";
-		interpreter.state.error_handled = false;
-		return {};
+// like print_definition, with one instruction per line annotated with how often it ran
+// and its share of the word's time, and with the bodies of rep loops (and of filter_n,
+// time and perf_stat) indented
+void print_annotated_definition(ProgramState &state, idx_t word_idx) {
+	assert(word_idx < length(state.words));
+	const Word &word = state.words[word_idx];
+	const ProfileCode &code = state.profile.code;
+
+	assert(word.code_pos <= length(state.code));
+	assert(word.code_pos + word.code_len <= length(state.code));
+	const idx_t end = word.code_pos + word.code_len;
+
+	auto entry = [&](idx_t pos) {
+		return pos < length(code) ? code[pos] : ProfileCodeEntry {};
+	};
+	// raw functions that run the body of length len after them themselves, [pos+1, pos+1+len),
+	// so that their time includes the body's
+	auto body_len = [&](idx_t pos) -> maybe_t<size_t> {
+		const Value value = state.code[pos];
+		if (value.type != Value::RawFunction) return {};
+		if (value.function_ptr != &rep_and && value.function_ptr != &filter_rf
+			&& value.function_ptr != &time_rf && value.function_ptr != &perf_stat_rf) return {};
+		if (pos == word.code_pos || state.code[pos-1].type != Value::Number) return {};
+		return state.code[pos-1].number.pos;
+	};
+	auto is_loop = [&](idx_t pos) {
+		const Value value = state.code[pos];
+		return value.function_ptr == &rep_and || value.function_ptr == &filter_rf;
+	};
+
+	// instructions outside of bodies add up to the time spent in the word,
+	// and the hottest loop is the one with the largest inclusive time
+	uint64_t total = 0;
+	maybe_t<idx_t> hottest_loop {};
+	bool tail_recursive = false;
+	for (idx_t pos = word.code_pos, top_level_from = pos; pos < end; ++pos) {
+		if (pos >= top_level_from) total += entry(pos).time;
+
+		const auto len = body_len(pos);
+		if (has(len)) {
+			if (pos >= top_level_from) top_level_from = pos + 1 + get(len);
+			if (is_loop(pos) && (!has(hottest_loop) || entry(get(hottest_loop)).time < entry(pos).time)) {
+				hottest_loop = pos;
+			}
+		}
+
+		const Value value = state.code[pos];
+		if (value.type == Value::RawFunction && value.function_ptr == &tail_recurse) tail_recursive = true;
 	}
 
-	const maybe_t<Value> val = interpreter.read_value();
-	if (!has(val)) {
-		// TODO:
-		// error_fun("def", "Couldn't find specified word");
-		interpreter.state.error = "Error: couldn't find the specified word";
+#ifdef KERNEL
+	printf(": %s ( %s )", word.name, word.desc);
+#else
+	writestring(state, ": ");
+	writestring(state, word.name);
+	writestring(state, " ( ");
+	writestring(state, word.desc);
+	writestring(state, " )");
+#endif
+	if (tail_recursive) writestring(state, " ( the whole word loops through tail_rec )");
+	writechar(state, '\n');
+	writestring(state, "       count   share  code (times in ");
+	writestring(state, PROFILE_CLOCK_UNIT);
+	writestringl(state, ")");
+
+	// ends of the bodies the current instruction is in, innermost last
+	idx_t loop_ends[PROFILE_MAX_DEPTH];
+	size_t depth = 0;
+	for (idx_t pos = word.code_pos; pos < end; ++pos) {
+		while (depth > 0 && loop_ends[depth-1] <= pos) --depth;
+
+		const Value value = state.code[pos];
+		if (value.type == Value::Syntax) {
+			state.error = "Error: syntax expression shouldn't be present in compiled word";
+			state.error_handled = false;
+			continue;
+		}
+
+		writenum_padded(state, entry(pos).count, 12);
+		if (total > 0) {
+			writechar(state, ' ');
+			write_permille(state, entry(pos).time * 1000 / total);
+		} else {
+			writestring(state, "       -");
+		}
+		writestring(state, "  ");
+		for (size_t i = 0; i < depth; ++i) writestring(state, "  ");
+		print_value(state, value);
+
+		const auto len = body_len(pos);
+		if (has(len)) {
+			if (is_loop(pos)) {
+				writestring(state, has(hottest_loop) && get(hottest_loop) == pos && entry(pos).time > 0
+					? "  <- loop, hottest"
+					: "  <- loop");
+			}
+			if (depth < PROFILE_MAX_DEPTH) loop_ends[depth++] = pos + 1 + get(len);
+		}
+		writechar(state, '\n');
+	}
+	writestring(state, ";");
+}
+#endif
+
+// the word after adef, which has to be one defined with :
+maybe_t<idx_t> read_adef_operand(Interpreter &interpreter) {
+	const maybe_t<Value> val = read_def_operand(interpreter);
+	if (!has(val)) return {};
+	if (get(val).type != Value::Word) {
+		interpreter.state.error = "Error: adef expects a word defined with :";
 		interpreter.state.error_handled = false;
 		return {};
 	}
+	return get(val).word_idx;
+}
+
+void interpret_adef(Interpreter &interpreter) {
+	const maybe_t<idx_t> word_idx = read_adef_operand(interpreter);
+	if (!has(word_idx)) return;
+
+#ifdef MIELIEPIT_PROFILE
+	print_annotated_definition(interpreter.state, get(word_idx));
+#else
+	interpreter.state.error = "Error: profiling support not compiled in (build with -DMIELIEPIT_PROFILE)";
+	interpreter.state.error_handled = false;
+#endif
+}
+
+void ignore_adef(Interpreter &interpreter) {
+	ignore_def(interpreter);
+}
+
+extern RawFunction print_annotated_definition_rf;
+maybe_t<size_t> compile_adef(Interpreter &interpreter) {
+	const maybe_t<idx_t> word_idx = read_adef_operand(interpreter);
+	if (!has(word_idx)) return {};
+
+	check_compile_code_len("adef", 2);
+	push(interpreter.state.code, Value::new_number({ .pos = get(word_idx) }));
+	push(interpreter.state.code, Value::new_function_ptr(&print_annotated_definition_rf));
+
+	return 2;
+}
+
+extern RawFunction print_definition_rf;
+maybe_t<size_t> compile_def(Interpreter &interpreter) {
+	const size_t start_len = length(interpreter.state.code);
 
-	const char *s_end = "`>";
-	const char *s_pri = "<built-in primitive `";
-	const char *s_syn = "<built-in syntax expression `";
-	const char *s_lit = "<literal ";
+	const maybe_t<Value> val = read_def_operand(interpreter);
+	if (!has(val)) return {};
 
 	switch (get(val).type) {
 		case Value::Word: {
@@ -1137,57 +2711,24 @@ maybe_t<size_t> compile_def(Interpreter &interpreter) {
 		case Value::Primitive: {
 			// TODO:
 			// check_code_len("def", ???);
-			const auto &primitive = interpreter.state.primitives[get(val).primitive_idx];
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s_pri)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(primitive.name)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s_end)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+			compile_print_static(interpreter.state, SS_DefPrimitive);
+			compile_print_name(interpreter.state, Value::Primitive, get(val).primitive_idx);
+			compile_print_static(interpreter.state, SS_DefEnd);
 		} break;
 		case Value::Syntax: {
 			// TODO:
 			// check_code_len("def", ???);
-
-			const auto &syntax = interpreter.state.syntax[get(val).syntax_idx];
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s_syn)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(syntax.name)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
-
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s_end)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+			compile_print_static(interpreter.state, SS_DefSyntax);
+			compile_print_name(interpreter.state, Value::Syntax, get(val).syntax_idx);
+			compile_print_static(interpreter.state, SS_DefEnd);
 		} break;
 		case Value::Number: {
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s_lit)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+			compile_print_static(interpreter.state, SS_DefLiteral);
 
 			push(interpreter.state.code, Value::new_number(get(val).number));
 			push(interpreter.state.code, Value::new_primitive(PW_Print));
 
-			push(interpreter.state.code, Value::new_number({
-				.pos = reinterpret_cast<idx_t>(s_end)
-			}));
-			push(interpreter.state.code, Value::new_function_ptr(&print_raw));
+			compile_print_static(interpreter.state, SS_DefEnd);
 		} break;
 		case Value::RawFunction: {
 			// TODO: some sort of error (maybe?)
@@ -1249,13 +2790,14 @@ maybe_t<size_t> compile_skip(Interpreter &interpreter) {
 	// check_code_len ...
 
 	push(interpreter.state.code, Value::new_number({ .pos = 0 }));
-	Value &skip_len = interpreter.state.code[length(interpreter.state.code)-1];
+	// an index rather than a reference, since compiling the next word may grow the code buffer
+	const idx_t skip_len_idx = length(interpreter.state.code)-1;
 
 	push(interpreter.state.code, Value::new_function_ptr(&skip));
 
 	const auto next_len = interpreter.compile_next();
 	if (has(next_len)) {
-		skip_len.number.pos = get(next_len);
+		interpreter.state.code[skip_len_idx].number.pos = get(next_len);
 
 		return get(next_len)+2;
 	} else {
@@ -1408,20 +2950,16 @@ void interpret_rep_and(Interpreter &interpreter) {
 
 		const size_t n = pop(interpreter.state.stack).pos;
 
-		for (size_t i = 0; i < n; ++i) {
-			Runner runner = { {
-				.code = &interpreter.state.code[code_pos],
-				.len = get(rep_len),
-			}, interpreter.state };
-
-			while (!interpreter.state.error && runner.curr.len > 0) {
-				runner.run_next();
-			}
+		for (size_t i = 0; i < n && !interpreter.state.error; ++i) {
+			run_compiled_section(code_pos, get(rep_len), interpreter.state);
 		}
 
 		while (length(interpreter.state.code) > initial_size) {
 			pop(interpreter.state.code);
 		}
+	#ifdef MIELIEPIT_PROFILE
+		profile_truncate_code(interpreter.state.profile, initial_size);
+	#endif
 
 		if (interpreter.state.error == nullptr) {
 			// TODO:
@@ -1447,13 +2985,14 @@ maybe_t<size_t> compile_rep_and(Interpreter &interpreter) {
 	// check_code_len ...
 
 	push(interpreter.state.code, Value::new_number({ .pos = 0 }));
-	Value &skip_len = interpreter.state.code[length(interpreter.state.code)-1];
+	// an index rather than a reference, since compiling the next word may grow the code buffer
+	const idx_t skip_len_idx = length(interpreter.state.code)-1;
 
 	push(interpreter.state.code, Value::new_function_ptr(&rep_and));
 
 	const auto next_len = interpreter.compile_next();
 	if (has(next_len)) {
-		skip_len.number.pos = get(next_len);
+		interpreter.state.code[skip_len_idx].number.pos = get(next_len);
 
 		return get(next_len)+2;
 	} else {
@@ -1478,9 +3017,186 @@ maybe_t<size_t> compile_rep(Interpreter &interpreter) {
 	if (has(rep_and_size)) {
 		assert(get(interpreter.compile_primitive_idx(PW_Drop)) == 1);
 
-		return get(rep_and_size) + 1;
+		return get(rep_and_size) + 1;
+	} else {
+		// TODO: error?
+		return {};
+	}
+}
+
+void interpret_filter_n(Interpreter &interpreter) {
+	const size_t initial_size = length(interpreter.state.code);
+	const idx_t code_pos = initial_size;
+	const auto pred_len = interpreter.compile_next();
+
+	if (has(pred_len)) {
+		filter_cells(interpreter.state, &interpreter.state.code[code_pos], get(pred_len), [&] {
+			run_compiled_section(code_pos, get(pred_len), interpreter.state);
+		});
+
+		while (length(interpreter.state.code) > initial_size) {
+			pop(interpreter.state.code);
+		}
+	#ifdef MIELIEPIT_PROFILE
+		profile_truncate_code(interpreter.state.profile, initial_size);
+	#endif
+	} else {
+		interpreter.state.error = "Error: invalid code after filter_n";
+		interpreter.state.error_handled = false;
+	}
+}
+
+void ignore_filter_n(Interpreter &interpreter) {
+	if (!interpreter.ignore_next() && interpreter.state.error == nullptr) {
+		interpreter.state.error = "Error: invalid code after filter_n";
+		interpreter.state.error_handled = false;
+	}
+}
+
+extern RawFunction filter_rf;
+maybe_t<size_t> compile_filter_n(Interpreter &interpreter) {
+	check_compile_code_len("filter_n", 2);
+
+	push(interpreter.state.code, Value::new_number({ .pos = 0 }));
+	// an index rather than a reference, since compiling the next word may grow the code buffer
+	const idx_t pred_len_idx = length(interpreter.state.code)-1;
+
+	push(interpreter.state.code, Value::new_function_ptr(&filter_rf));
+
+	const auto pred_len = interpreter.compile_next();
+	if (has(pred_len)) {
+		interpreter.state.code[pred_len_idx].number.pos = get(pred_len);
+
+		return get(pred_len)+2;
+	} else {
+		pop(interpreter.state.code); // filter_rf function
+		pop(interpreter.state.code); // predicate length
+
+		if (interpreter.state.error == nullptr) {
+			interpreter.state.error = "Error: invalid code after filter_n";
+			interpreter.state.error_handled = false;
+		}
+
+		return {};
+	}
+}
+
+// pushes what `time` measured; the error macros are gone by here, so the
+// capacity check is spelled out
+void push_time(ProgramState &state, uint64_t ns, uint64_t cycles) {
+#ifdef KERNEL
+	if (length(state.stack) + 2 >= STACK_SIZE) {
+		state.error = "Error in `time`: stack capacity should be at least 2";
+		state.error_handled = false;
+		return;
+	}
+#endif
+	push(state.stack, { .pos = (size_t)ns });
+	push(state.stack, { .pos = (size_t)cycles });
+	note_stack_depth(state);
+}
+
+void interpret_time(Interpreter &interpreter) {
+	const uint64_t start_ns = clock_ns();
+	const uint64_t start_cycles = clock_cycles();
+
+	if (!interpreter.run_next()) {
+		if (interpreter.state.error) return;
+		interpreter.state.error = "Error: expected a word to time";
+		interpreter.state.error_handled = false;
+		return;
+	}
+
+	const uint64_t cycles = clock_cycles() - start_cycles;
+	const uint64_t ns = clock_ns() - start_ns;
+
+	if (interpreter.state.error == nullptr) push_time(interpreter.state, ns, cycles);
+}
+
+void ignore_time(Interpreter &interpreter) {
+	if (!interpreter.ignore_next() && interpreter.state.error == nullptr) {
+		interpreter.state.error = "Error: expected a word to time";
+		interpreter.state.error_handled = false;
+	}
+}
+
+extern RawFunction time_rf;
+maybe_t<size_t> compile_time(Interpreter &interpreter) {
+	check_compile_code_len("time", 2);
+
+	push(interpreter.state.code, Value::new_number({ .pos = 0 }));
+	const idx_t time_len_idx = length(interpreter.state.code)-1;
+
+	push(interpreter.state.code, Value::new_function_ptr(&time_rf));
+
+	const auto next_len = interpreter.compile_next();
+	if (has(next_len)) {
+		interpreter.state.code[time_len_idx].number.pos = get(next_len);
+
+		return get(next_len)+2;
+	} else {
+		pop(interpreter.state.code); // time function
+		pop(interpreter.state.code); // code length
+
+		if (interpreter.state.error == nullptr) {
+			interpreter.state.error = "Error: expected a word to time";
+			interpreter.state.error_handled = false;
+		}
+
+		return {};
+	}
+}
+
+void interpret_perf_stat(Interpreter &interpreter) {
+	PerfCounts before, after;
+	perf_open();
+
+	const uint64_t start_ns = clock_ns();
+	perf_read(before);
+
+	if (!interpreter.run_next()) {
+		if (interpreter.state.error) return;
+		interpreter.state.error = "Error: expected a word to measure";
+		interpreter.state.error_handled = false;
+		return;
+	}
+
+	perf_read(after);
+	const uint64_t ns = clock_ns() - start_ns;
+
+	if (interpreter.state.error == nullptr) perf_stat_report(interpreter.state, before, after, ns);
+}
+
+void ignore_perf_stat(Interpreter &interpreter) {
+	if (!interpreter.ignore_next() && interpreter.state.error == nullptr) {
+		interpreter.state.error = "Error: expected a word to measure";
+		interpreter.state.error_handled = false;
+	}
+}
+
+extern RawFunction perf_stat_rf;
+maybe_t<size_t> compile_perf_stat(Interpreter &interpreter) {
+	check_compile_code_len("perf_stat", 2);
+
+	push(interpreter.state.code, Value::new_number({ .pos = 0 }));
+	const idx_t perf_stat_len_idx = length(interpreter.state.code)-1;
+
+	push(interpreter.state.code, Value::new_function_ptr(&perf_stat_rf));
+
+	const auto next_len = interpreter.compile_next();
+	if (has(next_len)) {
+		interpreter.state.code[perf_stat_len_idx].number.pos = get(next_len);
+
+		return get(next_len)+2;
 	} else {
-		// TODO: error?
+		pop(interpreter.state.code); // perf_stat function
+		pop(interpreter.state.code); // code length
+
+		if (interpreter.state.error == nullptr) {
+			interpreter.state.error = "Error: expected a word to measure";
+			interpreter.state.error_handled = false;
+		}
+
 		return {};
 	}
 }
@@ -1569,13 +3285,107 @@ maybe_t<size_t> compile_block(Interpreter &interpreter) {
 	}
 }
 
+void interpret_include(Interpreter &interpreter) {
+	interpreter.get_word();
+
+	if (interpreter.curr_word.len == 0) {
+		interpreter.state.error = "Error: expected file name after `include`";
+		interpreter.state.error_handled = false;
+		return;
+	}
+	interpreter.curr_word.handled = true;
+
+#ifdef KERNEL
+	interpreter.state.error = "Error: include is not available in the kernel";
+	interpreter.state.error_handled = false;
+#else
+	include_file(interpreter.state, interpreter.curr_word.text, interpreter.curr_word.len);
+#endif
+}
+
+void ignore_include(Interpreter &interpreter) {
+	interpreter.get_word();
+	interpreter.curr_word.handled = true;
+}
+
+void interpret_ffi(Interpreter &interpreter) {
+	// LIB SYMBOL ARGS RETS
+#ifndef KERNEL
+	std::string parts[4];
+#endif
+	for (size_t i = 0; i < 4; ++i) {
+		interpreter.get_word();
+		if (interpreter.curr_word.len == 0) {
+			interpreter.state.error = "Error: expected a library, a symbol and the argument and result types after `ffi`";
+			interpreter.state.error_handled = false;
+			return;
+		}
+		interpreter.curr_word.handled = true;
+#ifndef KERNEL
+		parts[i].assign(interpreter.curr_word.text, interpreter.curr_word.len);
+#endif
+	}
+
+#ifdef KERNEL
+	interpreter.state.error = "Error: ffi is not available in the kernel";
+	interpreter.state.error_handled = false;
+#else
+	const char *error;
+	if (!has(ffi_bind(interpreter.state, parts[0].c_str(), parts[1].c_str(), parts[2].c_str(), parts[3].c_str(), &error))) {
+		interpreter.state.error = error;
+		interpreter.state.error_handled = false;
+	}
+#endif
+}
+
+void ignore_ffi(Interpreter &interpreter) {
+	for (size_t i = 0; i < 4; ++i) {
+		interpreter.get_word();
+		interpreter.curr_word.handled = true;
+	}
+}
+
 /*** SECTION: Raw function values ***/
 
-RawFunction print_raw = { "<internal:print_raw>", [](Runner &runner) {
-	// TODO:
-	// check_stack_len_ge("<internal:print_raw>", 1);
-	const char *str = reinterpret_cast<const char*>(pop(runner.state.stack).pos);
-	writestring(str);
+RawFunction print_static = { "<internal:print_static>", [](Runner &runner) {
+	// compile_print_static put the index right before this, so it is always there
+	const idx_t str = pop(runner.state.stack).pos;
+	assert(str < SS_COUNT);
+	writestring(runner.state, static_strings[str]);
+} };
+
+// looks up the name or description of a word, primitive or syntax item from the
+// type and index on the stack, which compile_print_name and compile_print_desc
+// put right before print_name and print_desc
+const char *pop_name_or_desc(ProgramState &state, bool desc) {
+	const idx_t idx = pop(state.stack).pos;
+	const idx_t type = pop(state.stack).pos;
+
+	switch (type) {
+		case Value::Word: {
+			assert(idx < length(state.words));
+			return desc ? state.words[idx].desc : state.words[idx].name;
+		}
+		case Value::Primitive: {
+			assert(idx < state.primitives_len);
+			return desc ? state.primitives[idx].desc : state.primitives[idx].name;
+		}
+		case Value::Syntax: {
+			assert(idx < state.syntax_len);
+			return desc ? state.syntax[idx].desc : state.syntax[idx].name;
+		}
+	}
+
+	assert(false && "only words, primitives and syntax items have names");
+	return "";
+}
+
+RawFunction print_name = { "<internal:print_name>", [](Runner &runner) {
+	writestring(runner.state, pop_name_or_desc(runner.state, false));
+} };
+
+RawFunction print_desc = { "<internal:print_desc>", [](Runner &runner) {
+	writestring(runner.state, pop_name_or_desc(runner.state, true));
 } };
 
 RawFunction print_definition_rf = { "<internal:print_definition>", [](Runner &runner) {
@@ -1585,6 +3395,18 @@ RawFunction print_definition_rf = { "<internal:print_definition>", [](Runner &ru
 	print_definition(runner.state, word_idx);
 } };
 
+RawFunction print_annotated_definition_rf = { "<internal:print_annotated_definition>", [](Runner &runner) {
+	// compile_adef put the word's index right before this, so it is always there
+	const idx_t word_idx = pop(runner.state.stack).pos;
+#ifdef MIELIEPIT_PROFILE
+	print_annotated_definition(runner.state, word_idx);
+#else
+	(void)word_idx;
+	runner.state.error = "Error: profiling support not compiled in (build with -DMIELIEPIT_PROFILE)";
+	runner.state.error_handled = false;
+#endif
+} };
+
 RawFunction tail_recurse = { "tail_rec", [](Runner &runner) {
 	runner.curr = runner.initial;
 } };
@@ -1594,13 +3416,15 @@ RawFunction recurse = { "rec", [](Runner &runner) {
 	run_compiled_section(
 		runner.initial.code - runner.state.code.buffer,
 		runner.initial.len,
-		runner.state
+		runner.state,
+		runner.word_idx
 	);
 	#else
 	run_compiled_section(
 		runner.initial.code - &*runner.state.code.begin(),
 		runner.initial.len,
-		runner.state
+		runner.state,
+		runner.word_idx
 	);
 	#endif
 } };
@@ -1623,6 +3447,46 @@ RawFunction skip = { "?", [](Runner &runner) {
 	}
 } };
 
+RawFunction time_rf = { "time", [](Runner &runner) {
+	// compile_time put the length right before this, so it is always there
+	const size_t time_len = pop(runner.state.stack).pos;
+	const Value *time_until = runner.curr.code + time_len;
+
+	const uint64_t start_ns = clock_ns();
+	const uint64_t start_cycles = clock_cycles();
+
+	// a `ret` inside the timed code jumps past time_until
+	while (!runner.state.error && runner.curr.code < time_until) {
+		runner.run_next();
+	}
+
+	const uint64_t cycles = clock_cycles() - start_cycles;
+	const uint64_t ns = clock_ns() - start_ns;
+
+	if (runner.state.error == nullptr) push_time(runner.state, ns, cycles);
+} };
+
+RawFunction perf_stat_rf = { "perf_stat", [](Runner &runner) {
+	// compile_perf_stat put the length right before this, so it is always there
+	const size_t perf_stat_len = pop(runner.state.stack).pos;
+	const Value *perf_stat_until = runner.curr.code + perf_stat_len;
+
+	PerfCounts before, after;
+	perf_open();
+
+	const uint64_t start_ns = clock_ns();
+	perf_read(before);
+
+	while (!runner.state.error && runner.curr.code < perf_stat_until) {
+		runner.run_next();
+	}
+
+	perf_read(after);
+	const uint64_t ns = clock_ns() - start_ns;
+
+	if (runner.state.error == nullptr) perf_stat_report(runner.state, before, after, ns);
+} };
+
 RawFunction rep_and = { "rep_and", [](Runner &runner) {
 	// TODO:
 	// check_stack_len_ge("rep_and", 2);
@@ -1653,6 +3517,65 @@ RawFunction rep_and = { "rep_and", [](Runner &runner) {
 	push(runner.state.stack, { .pos = reps });
 } };
 
+// runs filter_n's predicate, the next pred_len values, once per cell, then skips it
+RawFunction filter_rf = { "filter_n", [](Runner &runner) {
+	const size_t pred_len = pop(runner.state.stack).pos;
+	const auto start_at = runner.curr;
+	const Value *pred_until = runner.curr.code + pred_len;
+
+	filter_cells(runner.state, runner.curr.code, pred_len, [&] {
+		runner.curr = start_at;
+		while (!runner.state.error && runner.curr.code < pred_until) {
+			runner.run_next();
+		}
+	});
+
+	assert(pred_len <= start_at.len);
+	runner.curr.code = start_at.code + pred_len;
+	runner.curr.len = start_at.len - pred_len;
+} };
+
+}
+
+#ifdef KERNEL
+// the hosted one is in mieliepit_ffi.cpp
+RawFunction ffi_call_rf = { "<internal:ffi_call>", [](Runner &runner) {
+	runner.state.error = "Error: ffi is not available in the kernel";
+	runner.state.error_handled = false;
+} };
+#endif
+
+// stable IDs for raw functions in images: only ever append to this list
+RawFunction *const raw_functions[] = {
+	&print_static,
+	&print_name,
+	&print_desc,
+	&print_definition_rf,
+	&print_annotated_definition_rf,
+	&tail_recurse,
+	&recurse,
+	&return_rf,
+	&skip,
+	&time_rf,
+	&perf_stat_rf,
+	&rep_and,
+	&ffi_call_rf,
+	&filter_rf,
+};
+const size_t RAW_FUNCTIONS_LEN = sizeof(raw_functions) / sizeof(*raw_functions);
+
+// whether code[i] is a number holding the index of a word, see compile_def and friends
+bool is_word_number(const ProgramState &state, idx_t begin, idx_t i, idx_t end) {
+	if (state.code[i].type != Value::Number || i+1 >= end) return false;
+	const Value next = state.code[i+1];
+	if (next.type != Value::RawFunction) return false;
+	if (next.function_ptr == &print_definition_rf || next.function_ptr == &print_annotated_definition_rf) {
+		return true;
+	}
+	return (next.function_ptr == &print_name || next.function_ptr == &print_desc)
+		&& i > begin
+		&& state.code[i-1].type == Value::Number
+		&& state.code[i-1].number.pos == Value::Word;
 }
 
 /*** SECTION: Syntax Array ***/
@@ -1745,6 +3668,495 @@ const Syntax syntax[SC_COUNT] = {
 		"[", "-- ; begins a [ block ], treated as one unit by ?, rep, etc",
 		interpret_block, ignore_block, compile_block,
 	},
+
+	/* TIMING */
+	[SC_Time] = {
+		"time", "-- ??? ns cycles ; runs the next word, then pushes how long it took in nanoseconds and cycles",
+		interpret_time, ignore_time, compile_time,
+	},
+	[SC_PerfStat] = {
+		"perf_stat", "-- ??? ; runs the next word, then prints its hardware counters (instructions, cycles, branch and cache misses)",
+		interpret_perf_stat, ignore_perf_stat, compile_perf_stat,
+	},
+
+	/* PROFILING */
+	[SC_AnnotatedDef] = {
+		"adef", "-- ; like def, but annotates every instruction with its execution count and share of the word's time while profiling",
+		interpret_adef, ignore_adef, compile_adef,
+	},
+
+	/* MODULES */
+	[SC_Include] = {
+		"include", "-- ; runs the file named by the next word, unless it was already included",
+		interpret_include, ignore_include,
+		[](Interpreter &interpreter) -> maybe_t<size_t> {
+			interpreter.state.error = "Error: include is not valid inside a word definition";
+			interpreter.state.error_handled = false;
+
+			return {};
+		},
+	},
+
+	/* FFI */
+	[SC_Ffi] = {
+		"ffi", "-- ; `ffi LIB SYMBOL ARGS RETS` defines SYMBOL as a word calling that C function; ARGS and RETS are counts of integers or letters (i 64 bit integer, w 32 bit int, d double), e.g. `ffi libm.so.6 pow dd d`",
+		interpret_ffi, ignore_ffi,
+		[](Interpreter &interpreter) -> maybe_t<size_t> {
+			interpreter.state.error = "Error: ffi is not valid inside a word definition";
+			interpreter.state.error_handled = false;
+
+			return {};
+		},
+	},
+
+	/* RANGE OPERATIONS */
+	[SC_FilterN] = {
+		"filter_n", "a1 ... an n -- b1 ... bk k ; keeps the elements for which the next word (cell -- flag) leaves a nonzero flag, e.g. `filter_n [ 10 < ]`",
+		interpret_filter_n, ignore_filter_n, compile_filter_n,
+	},
+};
+
+
+
+
+
+
+/*** SECTION: Hardware counters ***/
+
+const char *const perf_counter_names[PC_COUNT] = {
+	[PC_Instructions] = "instructions",
+	[PC_Cycles] = "cycles",
+	[PC_BranchMisses] = "branch-misses",
+	[PC_L1dMisses] = "L1d-misses",
+	[PC_LLCMisses] = "LLC-misses",
 };
 
+// the hosted ones are in mieliepit_perf.cpp
+#ifdef KERNEL
+bool perf_open() { return false; }
+void perf_close() { }
+const char *perf_error() {
+	return "hardware counters are not supported on this platform";
+}
+bool perf_counter_available(PerfCounter) { return false; }
+bool perf_read(PerfCounts &counts) {
+	for (size_t i = 0; i < PC_COUNT; ++i) counts.counts[i] = 0;
+	return false;
+}
+#endif
+
+
+/*** SECTION: Memory statistics ***/
+
+namespace {
+
+#ifdef KERNEL
+template<typename T, size_t CAPACITY>
+BufferStats buffer_stats(const FixedBuffer<T, CAPACITY> &buf) {
+	return { buf.len * sizeof(T), CAPACITY * sizeof(T) };
+}
+#else
+template<typename T>
+BufferStats buffer_stats(const std::vector<T> &vec) {
+	return { vec.size() * sizeof(T), vec.capacity() * sizeof(T) };
+}
+#endif
+
+void print_buffer_stats(const ProgramState &state, const char *name, BufferStats stats) {
+	writestring_padded(state, name, 12);
+	writenum_padded(state, stats.used, 12);
+	writenum_padded(state, stats.capacity, 12);
+	writenum_padded(state, stats.capacity ? stats.used * 100 / stats.capacity : 0, 5);
+	writestringl(state, "%");
+}
+
+}
+
+MemStats mem_stats(const ProgramState &state) {
+	MemStats stats = {
+		.stack = buffer_stats(state.stack),
+		.heap = buffer_stats(state.heap),
+		.code = buffer_stats(state.code),
+		.words = buffer_stats(state.words),
+		.word_names = { state.word_names_buf.second, WORD_NAMES_BUF_SIZE },
+		.word_descs = { state.word_descs_buf.second, WORD_DESCS_BUF_SIZE },
+		.stack_high_water = length(state.stack) > state.stack_high_water
+			? length(state.stack)
+			: state.stack_high_water,
+		.shadowed_words = 0,
+		.unreachable_code = 0,
+	};
+
+	const size_t words_len = length(state.words);
+#ifdef KERNEL
+	static bool reachable[CODE_BUFFER_SIZE];
+	static idx_t worklist[CODE_BUFFER_SIZE];
+	for (size_t i = 0; i < words_len; ++i) reachable[i] = false;
+#else
+	std::vector<bool> reachable(words_len, false);
+	std::vector<idx_t> worklist(words_len);
+#endif
+	size_t worklist_len = 0;
+
+	// the names seen so far, as an open addressed table of word indices
+	// at most half full
+	size_t names_len = 1;
+	while (names_len < 2 * words_len) names_len *= 2;
+#ifdef KERNEL
+	static idx_t names[2 * CODE_BUFFER_SIZE];
+#else
+	std::vector<idx_t> names(names_len);
+#endif
+	for (size_t i = 0; i < names_len; ++i) names[i] = NO_WORD;
+
+	// every word that can still be looked up by name is reachable, and so is
+	// every word its code refers to, even if that one has since been shadowed.
+	// going from the newest word, a word is shadowed if its name was seen already
+	for (idx_t i = words_len; i-- > 0;) {
+		const char *name = state.words[i].name;
+		uint64_t hash = 0xcbf29ce484222325; // FNV-1a
+		for (const char *c = name; *c; ++c) hash = (hash ^ (uint8_t)*c) * 0x100000001b3;
+
+		size_t slot = hash & (names_len - 1);
+		bool shadowed = false;
+		while (names[slot] != NO_WORD && !shadowed) {
+			shadowed = strcmp(state.words[names[slot]].name, name) == 0;
+			slot = (slot + 1) & (names_len - 1);
+		}
+
+		if (shadowed) {
+			++stats.shadowed_words;
+		} else {
+			names[slot] = i;
+			reachable[i] = true;
+			worklist[worklist_len++] = i;
+		}
+	}
+	while (worklist_len > 0) {
+		const Word &word = state.words[worklist[--worklist_len]];
+		for (idx_t pos = word.code_pos; pos < word.code_pos + word.code_len; ++pos) {
+			const Value &value = state.code[pos];
+			if (value.type != Value::Word || value.word_idx >= words_len) continue;
+			if (reachable[value.word_idx]) continue;
+
+			reachable[value.word_idx] = true;
+			worklist[worklist_len++] = value.word_idx;
+		}
+	}
+
+	// words don't overlap, so whatever isn't covered by a reachable word is dead
+	size_t reachable_cells = 0;
+	for (idx_t i = 0; i < words_len; ++i) {
+		if (reachable[i]) reachable_cells += state.words[i].code_len;
+	}
+	stats.unreachable_code = (length(state.code) - reachable_cells) * sizeof(Value);
+
+	return stats;
+}
+
+void print_mem_stats(const ProgramState &state, const MemStats &stats) {
+	writestringl(state, "buffer            used B  capacity B  use");
+	print_buffer_stats(state, "stack", stats.stack);
+	print_buffer_stats(state, "heap", stats.heap);
+	print_buffer_stats(state, "code", stats.code);
+	print_buffer_stats(state, "words", stats.words);
+	print_buffer_stats(state, "word names", stats.word_names);
+	print_buffer_stats(state, "word descs", stats.word_descs);
+	writestring(state, "stack high water: ");
+	writenum_padded(state, stats.stack_high_water, 0);
+	writestringl(state, " cells");
+	writestring(state, "shadowed words: ");
+	writenum_padded(state, stats.shadowed_words, 0);
+	writechar(state, '\n');
+	writestring(state, "unreachable code: ");
+	writenum_padded(state, stats.unreachable_code, 0);
+	writestringl(state, " B");
+}
+
+
+
+/*** SECTION: Numeric input ***/
+
+#ifndef KERNEL
+namespace {
+
+constexpr size_t INPUT_BUF_SIZE = 1 << 20;
+// numbers are found 64 bytes at a time; one starting in a block (at most 21 bytes
+// with its sign, read 8 at a time) always fits in this much buffered input,
+// unless the input ends first
+constexpr size_t INPUT_BLOCK = 64;
+constexpr size_t INPUT_LOOKAHEAD = 2 * INPUT_BLOCK;
+// past the end of the input, zeroed where numbers can be read into it
+constexpr size_t INPUT_PADDING = INPUT_BLOCK + 16;
+
+// moves what is left to the front and reads until at least want bytes are buffered
+void input_fill(InputReader &reader, size_t want) {
+	if (reader.pos > 0) {
+		memmove(reader.buf.data(), reader.buf.data() + reader.pos, reader.end - reader.pos);
+		reader.end -= reader.pos;
+		reader.pos = 0;
+	}
+	while (reader.end < want && !reader.eof && !reader.failed) {
+		const ssize_t got = read(reader.fd, reader.buf.data() + reader.end, INPUT_BUF_SIZE - reader.end);
+		if (got > 0) {
+			reader.end += got;
+		} else if (got == 0) {
+			reader.eof = true;
+		} else if (errno != EINTR) {
+			reader.failed = true;
+		}
+	}
+	memset(reader.buf.data() + reader.end, 0, 16);
+}
+
+uint64_t load8(const char *at) {
+	uint64_t v;
+	memcpy(&v, at, sizeof(v));
+	return v;
+}
+
+// one bit per byte of the block each, set for digits and for minus signs
+void classify_block(const char *block, uint64_t &digits, uint64_t &minuses) {
+	digits = minuses = 0;
+#ifdef __SSE2__
+	for (size_t i = 0; i < INPUT_BLOCK; i += 16) {
+		const __m128i chunk = _mm_loadu_si128((const __m128i *)(block + i));
+		const __m128i is_digit = _mm_and_si128(
+			_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+			_mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1))
+		);
+		const __m128i is_minus = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('-'));
+		digits |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_digit) << i;
+		minuses |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_minus) << i;
+	}
+#else
+	for (size_t i = 0; i < INPUT_BLOCK; ++i) {
+		digits |= (uint64_t)('0' <= block[i] && block[i] <= '9') << i;
+		minuses |= (uint64_t)(block[i] == '-') << i;
+	}
+#endif
+}
+
+// how many of the 8 bytes in v (in memory order, so little-endian) are digits before the first non-digit
+unsigned digit_run(uint64_t v) {
+	// a byte is a digit iff its high nibble is 3, also after adding 6; a carry out
+	// of a byte only happens for bytes >= 0xfa, which end the run anyway
+	const uint64_t nibbles = (v & 0xf0f0f0f0f0f0f0f0) | (((v + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) >> 4);
+	const uint64_t non_digits = nibbles ^ 0x3333333333333333;
+	return non_digits ? __builtin_ctzll(non_digits) / 8 : 8;
+}
+
+// the value of the first len (0 to 8) digits in v, all at once
+uint64_t parse_digits(uint64_t v, unsigned len) {
+	// pad with leading zeros (bytes past the digits may borrow, but are shifted out);
+	// done in two steps, as shifting by 64 wouldn't clear v
+	v = ((v - 0x3030303030303030) << (4 * (8 - len))) << (4 * (8 - len));
+	v = (v * 10) + (v >> 8);
+	return (((v & 0x000000ff000000ff) * (100 + (1000000ull << 32)))
+		+ (((v >> 16) & 0x000000ff000000ff) * (1 + (10000ull << 32)))) >> 32;
+}
+
+bool is_digit(char ch) {
+	return '0' <= ch && ch <= '9';
+}
+
+constexpr uint64_t powers_of_ten[9] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+
+// the value of the len digits at the start of at, or nothing if it doesn't fit
+maybe_t<uint64_t> parse_number(const char *at, size_t len) {
+	if (len <= 8) return parse_digits(load8(at), len);
+	if (len <= 16) return parse_digits(load8(at), 8) * powers_of_ten[len - 8] + parse_digits(load8(at + 8), len - 8);
+	if (len > 20) return {};
+
+	uint64_t value = parse_digits(load8(at), 8) * powers_of_ten[8] + parse_digits(load8(at + 8), 8);
+	const size_t rest = len - 16;
+	if (__builtin_mul_overflow(value, powers_of_ten[rest], &value)
+		|| __builtin_add_overflow(value, parse_digits(load8(at + 16), rest), &value)) {
+		return {};
+	}
+	return value;
+}
+
+// counts the digits at the start of at, for numbers running past the end of a block
+size_t count_digits(const char *at) {
+	size_t len = 0, run;
+	while ((run = digit_run(load8(at + len))) == 8 && len < 24) len += run;
+	return len + run;
+}
+
+}
+
+ReadNumbers read_numbers(ProgramState &state, int fd, number_t *out, size_t n) {
+	if (state.last_input_reader == nullptr || state.last_input_reader->fd != fd) {
+		const auto [it, added] = state.input_readers.try_emplace(fd);
+		if (added) {
+			it->second.fd = fd;
+			it->second.buf.resize(INPUT_BUF_SIZE + INPUT_PADDING);
+		}
+		state.last_input_reader = &it->second;
+	}
+	InputReader &reader = *state.last_input_reader;
+
+	size_t count = 0;
+	ReadNumbers::Status status = ReadNumbers::Ok;
+	while (count < n) {
+		if (reader.end - reader.pos < INPUT_LOOKAHEAD && !reader.eof && !reader.failed) {
+			input_fill(reader, INPUT_LOOKAHEAD);
+		}
+		if (reader.pos >= reader.end) break;
+
+		// every digit after a non-digit starts a number, and finding them all at once
+		// means parsing one number needn't wait for the previous one to be parsed
+		const char *const base = reader.buf.data();
+		const char *const block = base + reader.pos;
+		const size_t valid = std::min(reader.end - reader.pos, INPUT_BLOCK);
+		uint64_t digits, minuses;
+		classify_block(block, digits, minuses);
+		if (valid < INPUT_BLOCK) digits &= ((uint64_t)1 << valid) - 1;
+		uint64_t starts = digits & ~((digits << 1) | is_digit(reader.before));
+		// bit i set if byte i-1 is a minus sign
+		minuses = (minuses << 1) | (reader.before == '-');
+
+		while (starts && count < n) {
+			const size_t offset = __builtin_ctzll(starts);
+			const char *const start = block + offset;
+			starts &= starts - 1;
+
+			// the length comes from the mask too, unless the number runs past the block
+			const uint64_t after = ~digits >> offset;
+			const size_t len = after ? __builtin_ctzll(after) : count_digits(start);
+			const bool negative = (minuses >> offset) & 1;
+			const auto parsed = parse_number(start, len);
+			const uint64_t value = get_or(parsed, (uint64_t)0);
+			if (!has(parsed) || (negative && value > (uint64_t)1 << 63)) {
+				status = ReadNumbers::TooLarge;
+				reader.pos = start - base;
+				reader.before = 0;
+				return { .count = count, .status = status };
+			}
+			out[count++] = { .pos = negative ? 0 - value : value };
+
+			if (count == n) {
+				// the rest of the block is for the next call
+				reader.pos = start + len - base;
+				reader.before = start[len-1];
+				return { .count = count, .status = status };
+			}
+		}
+
+		reader.pos += valid;
+		reader.before = block[valid-1];
+	}
+
+	if (reader.failed) status = ReadNumbers::Failed;
+	return { .count = count, .status = status };
+}
+#endif
+
+/*** SECTION: Binary cells ***/
+
+#ifndef KERNEL
+bool load_cells(Stack &stack, const char *path, size_t &count, const char **error) {
+	const char *ignored;
+	if (error == nullptr) error = &ignored;
+
+	const int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		*error = "could not open the file";
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		*error = "not a regular file";
+		return false;
+	}
+	if (st.st_size % sizeof(number_t) != 0) {
+		close(fd);
+		*error = "the file size is not a whole number of cells";
+		return false;
+	}
+
+	const size_t start = length(stack);
+	const size_t size = st.st_size;
+	stack.resize(start + size / sizeof(number_t));
+	char *data = (char *)(stack.data() + start);
+	size_t got = 0;
+	while (got < size) {
+		const ssize_t res = read(fd, data + got, size - got);
+		if (res < 0 && errno == EINTR) continue;
+		if (res <= 0) break;
+		got += res;
+	}
+	close(fd);
+	if (got < size) {
+		stack.resize(start);
+		*error = "could not read the file";
+		return false;
+	}
+
+	count = size / sizeof(number_t);
+	return true;
+}
+
+bool dump_cells(const number_t *cells, size_t n, const char *path, const char **error) {
+	const char *ignored;
+	if (error == nullptr) error = &ignored;
+
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		*error = "could not open the file";
+		return false;
+	}
+
+	// one write normally takes everything, but pipes and signals can cut it short
+	const char *data = (const char *)cells;
+	size_t left = n * sizeof(number_t);
+	while (left) {
+		const ssize_t wrote = write(fd, data, left);
+		if (wrote < 0 && errno == EINTR) continue;
+		if (wrote <= 0) {
+			close(fd);
+			*error = "could not write the file";
+			return false;
+		}
+		data += wrote;
+		left -= wrote;
+	}
+
+	if (close(fd) != 0) {
+		*error = "could not write the file";
+		return false;
+	}
+	return true;
+}
+#endif
+
+/*** SECTION: Host primitives ***/
+
+#ifndef KERNEL
+maybe_t<idx_t> register_primitive(ProgramState &state, const char *name, const char *desc, void (*fun)(ProgramState&)) {
+	const size_t name_len = strlen(name);
+	if (name_len == 0) return {};
+	for (size_t i = 0; i < name_len; ++i) {
+		if (Interpreter::is_space(name[i])) return {};
+	}
+	// "-- c ; ..." or "a b -- c ; ..."
+	if (strncmp(desc, "--", 2) != 0 && strstr(desc, " --") == nullptr) return {};
+	for (idx_t i = 0; i < state.primitives_len; ++i) {
+		if (strcmp(state.primitives[i].name, name) == 0) return {};
+	}
+
+	// the first registration copies the built-in table, which is shared and constant
+	if (state.own_primitives.empty()) {
+		state.own_primitives.assign(state.primitives, state.primitives + state.primitives_len);
+	}
+	state.own_primitives.push_back({ .name = name, .desc = desc, .fun = fun });
+	state.primitives = state.own_primitives.data();
+	state.primitives_len = state.own_primitives.size();
+	return state.primitives_len - 1;
+}
+#endif
+
+
 }
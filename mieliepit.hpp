@@ -10,7 +10,9 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <map>
 #include <optional>
+#include <string>
 #include <vector>
 #endif
 
@@ -236,6 +238,15 @@ static number_t &stack_peek(Stack &stack, idx_t nth = 0) {
 	return stack[length(stack)-1 - nth];
 }
 
+// linear memory for `allot`, `@`, `!` and friends, addressed in bytes from 0
+#ifdef KERNEL
+constexpr size_t HEAP_SIZE = 4096;
+using Heap = FixedBuffer<uint8_t, HEAP_SIZE>;
+#else
+constexpr size_t HEAP_SIZE = (size_t)1 << 30; // a limit rather than a capacity, so a runaway `allot` fails cleanly
+using Heap = std::vector<uint8_t>;
+#endif
+
 #ifdef KERNEL
 constexpr size_t CODE_BUFFER_SIZE = 1024;
 using CodeBuffer = FixedBuffer<Value, CODE_BUFFER_SIZE>;
@@ -268,8 +279,142 @@ using Words = FixedBuffer<Word, CODE_BUFFER_SIZE>;
 using Words = std::vector<Word>;
 #endif
 
+// Hardware performance counters, read through perf_event_open on Linux.
+enum PerfCounter {
+	PC_Instructions,
+	PC_Cycles,
+	PC_BranchMisses,
+	PC_L1dMisses,
+	PC_LLCMisses,
+
+	PC_COUNT,
+};
+
+struct PerfCounts {
+	uint64_t counts[PC_COUNT];
+};
+
+// Build with -DMIELIEPIT_PROFILE to enable the per-word profiler.
+// Without it the hooks are compiled out entirely.
+#ifdef MIELIEPIT_PROFILE
+struct ProfileEntry {
+	uint64_t calls = 0;
+	uint64_t exclusive = 0;
+	uint64_t inclusive = 0;
+	size_t max_stack = 0;
+	size_t active = 0; // recursion depth, so inclusive time isn't counted twice
+	PerfCounts perf {}; // exclusive hardware counts, when Profile::perf is set
+};
+
+struct ProfileFrame {
+	bool is_word;
+	idx_t idx;
+	uint64_t start;
+	uint64_t children;
+	PerfCounts perf_start;
+	PerfCounts perf_children;
+};
+
+// one per cell of ProgramState::code, for `adef`
+struct ProfileCodeEntry {
+	uint64_t count = 0;
+	uint64_t time = 0; // inclusive, so a loop's time contains its body's
+};
+
+constexpr size_t PROFILE_MAX_DEPTH = 256;
+
+#ifdef KERNEL
+using ProfileEntries = FixedBuffer<ProfileEntry, CODE_BUFFER_SIZE>;
+using ProfileFrames = FixedBuffer<ProfileFrame, PROFILE_MAX_DEPTH>;
+using ProfileCode = FixedBuffer<ProfileCodeEntry, CODE_BUFFER_SIZE>;
+#else
+using ProfileEntries = std::vector<ProfileEntry>;
+using ProfileFrames = std::vector<ProfileFrame>;
+using ProfileCode = std::vector<ProfileCodeEntry>;
+#endif
+
+struct Profile {
+	bool enabled = false;
+	bool perf = false; // also collect hardware counters, see perf_open
+	ProfileEntries words {};
+	ProfileEntries primitives {};
+	ProfileFrames frames {};
+	ProfileCode code {};
+	size_t overflow = 0; // frames that didn't fit within PROFILE_MAX_DEPTH
+	size_t max_stack = 0;
+};
+#endif
+
+// Execution tracing: when enabled, every executed value is recorded into a
+// fixed-size ring buffer, so the last few steps can be dumped after an error.
+#ifdef KERNEL
+constexpr size_t TRACE_RING_SIZE = 256;
+#else
+constexpr size_t TRACE_RING_SIZE = 4096;
+#endif
+static_assert(
+	(TRACE_RING_SIZE & (TRACE_RING_SIZE-1)) == 0,
+	"Expected trace ring size to be a power of two"
+);
+
+struct TraceRecord {
+	idx_t word_idx; // NO_WORD when not running inside a word
+	idx_t code_offset; // into ProgramState::code, NO_WORD when interpreting
+	Value value;
+	number_t top; // top of the stack before executing value
+	size_t stack_len;
+};
+
+struct Trace {
+	bool enabled = false;
+	uint64_t head = 0; // total records written, the ring index is head % TRACE_RING_SIZE
+	TraceRecord *records = nullptr; // TRACE_RING_SIZE of them, from the first trace_enable on
+};
+
+#ifndef KERNEL
+// a file loaded with `include`, see include_file
+struct Module {
+	std::string path; // canonical, so every file is only included once
+	uint64_t key = 0; // hash of the source and the keys of the modules it includes
+	bool open = true; // still being included, so the key isn't known yet
+	bool cacheable = true; // only defines words and includes other modules
+	idx_t words_begin = 0;
+	// the include statements run while this module was being included, in order
+	struct Include {
+		size_t module; // into ProgramState::modules
+		idx_t at_word; // length of ProgramState::words before the include
+		size_t words; // words it defined, 0 if the module was already included
+	};
+	std::vector<Include> includes {};
+};
+using Modules = std::vector<Module>;
+
+constexpr size_t FFI_MAX_INT_ARGS = 6; // what fits in argument registers on x86-64 and arm64
+constexpr size_t FFI_MAX_DOUBLE_ARGS = 8;
+// a C function bound with `ffi`, see ffi_bind
+struct FfiBinding {
+	uint64_t key; // hash of the library, symbol and types, which words find their binding by
+	void *fun;
+	char args[FFI_MAX_INT_ARGS + FFI_MAX_DOUBLE_ARGS + 1]; // 'i', 'w' or 'd' per argument, in order
+	uint8_t args_len;
+	char ret; // 'i', 'w', 'd' or 0 for no result
+};
+
+// a file descriptor read by read_numbers, with whatever was read past the last number
+struct InputReader {
+	int fd = -1;
+	std::vector<char> buf {};
+	size_t pos = 0;
+	size_t end = 0;
+	char before = 0; // the byte before pos, which may have been moved out of buf
+	bool eof = false;
+	bool failed = false;
+};
+#endif
+
 struct ProgramState {
 	Stack stack {};
+	Heap heap {};
 	CodeBuffer code {};
 	WordNamesBuf word_names_buf { nullptr, 0 };
 	WordDescsBuf word_descs_buf { nullptr, 0 };
@@ -282,6 +427,39 @@ const char *error = nullptr;
 	const Syntax *syntax;
 	size_t syntax_len;
 
+	// innermost active runner, linked to the outer ones through Runner::parent.
+	// it is published so that signal handlers (the sampling profiler) can
+	// see what is currently executing
+	Runner *volatile running = nullptr;
+
+	Trace trace {};
+
+	size_t stack_high_water = 0; // deepest stack seen, kept by whatever grows it, see mem_stats
+
+#ifdef MIELIEPIT_PROFILE
+	bool trampolines = false; // call words through native stubs, see native_symbols_start
+#endif
+
+#ifndef KERNEL
+	Modules modules {};
+	std::string module_cache_dir {}; // where compiled modules are kept, empty for no cache
+
+	std::vector<Primitive> own_primitives {}; // primitives points here once any are registered
+	// where everything the program prints goes, in pieces of any size: write_stdout
+	// unless changed, which is handed output_user along with each piece
+	void (*output)(void *user, const char *data, size_t len) = nullptr;
+	void *output_user = nullptr;
+	void *host = nullptr; // for the embedding program, see mieliepit_c.h
+	std::vector<FfiBinding> ffi {}; // one per bound function; the words `ffi` defines hold an index and key
+	std::string ffi_error {}; // what ffi_bind's error points to when it has more to say than a fixed message
+	std::map<int, InputReader> input_readers {}; // by descriptor, see read_numbers
+	InputReader *last_input_reader = nullptr; // scripts usually read from one descriptor, so skip the lookup for that one
+#endif
+
+#ifdef MIELIEPIT_PROFILE
+	Profile profile {};
+#endif
+
 	ProgramState(const Primitive *primitives, size_t primitives_len, const Syntax *syntax, size_t syntax_len);
 	~ProgramState();
 
@@ -298,15 +476,29 @@ struct Interpreter {
 	} curr_word;
 	ProgramState &state;
 
+	// line breaks count as spaces, so that a whole file can be one "line"
+	static bool is_space(char ch) {
+		return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r';
+	}
+
+	// points the interpreter at source, which is read in place and must outlive it;
+	// trailing whitespace is dropped, as it would otherwise be read as one last, empty word
+	void set_source(const char *source, size_t source_len) {
+		while (source_len > 0 && is_space(source[source_len-1])) --source_len;
+		line = source;
+		len = source_len;
+		curr_word = {};
+	}
+
 	void get_word() {
 		if (curr_word.text != nullptr && !curr_word.handled) return;
 
-		while (len > 0 && line[0] == ' ') {
+		while (len > 0 && is_space(line[0])) {
 			--len;
 			++line;
 		}
 		curr_word.text = line;
-		while (len > 0 && line[0] != ' ') {
+		while (len > 0 && !is_space(line[0])) {
 			--len;
 			++line;
 		}
@@ -506,6 +698,8 @@ maybe_t<idx_t> read_primitive_idx() {
 	bool ignore_next();
 };
 
+constexpr idx_t NO_WORD = (idx_t)-1;
+
 struct Runner {
 	struct CodePos {
 		Value *code = nullptr;
@@ -514,10 +708,13 @@ struct Runner {
 	CodePos initial;
 	CodePos curr;
 
+	idx_t word_idx; // NO_WORD when running anonymous code, eg. an interpreted rep loop
+	Runner *parent = nullptr; // enclosing runner, see ProgramState::running
+
 	ProgramState &state;
 
-	Runner(CodePos at, ProgramState &state)
-	: initial(at), curr(at), state(state) { }
+	Runner(CodePos at, ProgramState &state, idx_t word_idx = NO_WORD)
+	: initial(at), curr(at), word_idx(word_idx), state(state) { }
 
 	maybe_t<Value> read_value() {
 		if (curr.len == 0) return {};
@@ -582,6 +779,168 @@ struct Runner {
 	bool ignore_next();
 };
 
+// The counters are opened on first use and count this thread in user space only.
+// Counters that can't be opened (not permitted in most containers, missing in
+// many VMs) read as 0; perf_open fails, with perf_error() saying why, only if
+// none of them are available. Always unavailable in the kernel.
+extern const char *const perf_counter_names[PC_COUNT];
+bool perf_open();
+void perf_close();
+const char *perf_error();
+bool perf_counter_available(PerfCounter counter);
+bool perf_read(PerfCounts &counts);
+
+// Sizes of the buffers in ProgramState, in bytes, for sizing the kernel's
+// FixedBuffer capacities and spotting leaks in long sessions.
+// Hosted capacities are what the vectors currently have allocated.
+struct BufferStats {
+	size_t used;
+	size_t capacity;
+};
+struct MemStats {
+	BufferStats stack, heap, code, words, word_names, word_descs;
+	size_t stack_high_water; // in cells
+	size_t shadowed_words; // entries hidden by a later word with the same name
+	size_t unreachable_code; // bytes of code that no visible word can reach
+};
+MemStats mem_stats(const ProgramState &state);
+void print_mem_stats(const ProgramState &state, const MemStats &stats);
+
+#ifndef KERNEL
+// the default ProgramState::output, which writes to stdout through stdio
+void write_stdout(void *user, const char *data, size_t len);
+#endif
+
+#ifndef KERNEL
+// Statistical profiler: a SIGPROF timer samples ProgramState::running on the thread that
+// called sampler_start, and a background thread aggregates the samples while it runs.
+// Only one state can be sampled at a time.
+bool sampler_start(ProgramState &state, unsigned hz);
+void sampler_stop();
+void sampler_reset();
+void sampler_print_flat(const ProgramState &state);
+// writes collapsed stacks ("outer;inner count" lines), as consumed by flame graph tools
+bool sampler_write_folded(const ProgramState &state, const char *path);
+#endif
+
+#ifndef KERNEL
+// Native profiler symbols: while enabled, every word call goes through a tiny
+// machine code trampoline of its own, named `mieliepit:NAME [interp]` in
+// /tmp/perf-<pid>.map and, optionally, in /tmp/jit-<pid>.dump (for
+// `perf inject --jit`), so `perf record -g` attributes samples to words.
+// Only available on x86-64 Linux in builds with -DMIELIEPIT_PROFILE (so that
+// the ordinary word call needn't check for it), and only one state can use it at a time.
+bool native_symbols_start(ProgramState &state, bool jitdump);
+void native_symbols_stop();
+#endif
+
+#ifndef KERNEL
+// Images: a relocatable snapshot of the words, code and word name and description
+// buffers, so a large prelude needn't be parsed and compiled on every start.
+// An image only loads with the same primitive, syntax and raw function tables.
+bool save_image(const ProgramState &state, const char *path);
+// maps the image and replaces all words and code in state with its contents, forgetting
+// the included modules and the profile, which describe the old ones;
+// on failure state is left untouched and error (if given) says why
+bool load_image(ProgramState &state, const char *path, const char **error = nullptr);
+// replaces all words, code and memory in to with copies of those in from, which must
+// have the same primitive and syntax tables; used to give threads their own state
+void copy_words(ProgramState &to, const ProgramState &from);
+#endif
+
+#ifndef KERNEL
+// Source files: a script is mapped read-only with sequential read-ahead and
+// interpreted in place (see Interpreter::set_source), so nothing is copied and
+// curr_word.text stays valid for error reports until the source is unmapped.
+struct SourceView {
+	const char *data;
+	size_t len;
+};
+maybe_t<SourceView> map_source(const char *path, const char **error = nullptr);
+// lets the kernel drop the pages before pos (they are reread if touched again),
+// so that running a huge script only keeps the part being interpreted resident
+void release_source_before(const SourceView &source, const char *pos);
+void unmap_source(const SourceView &source);
+#endif
+
+#ifndef KERNEL
+// Modules: `include PATH` runs a file once per session, by canonical path;
+// relative paths are relative to the including module (or the working directory).
+// With a module_cache_dir, a module that only defines words (and includes other
+// modules) is stored there once compiled, with references to words kept by name,
+// and later sessions load it from there without parsing, as long as neither its
+// source nor anything it includes changed. Errors are reported like the syntax's.
+void include_file(ProgramState &state, const char *path, size_t path_len);
+#endif
+
+#ifndef KERNEL
+// Numeric input: integers are read from a file descriptor through a large buffer
+// (one per descriptor and state, kept until the end of the input) and parsed up to 8 digits
+// at a time. Anything other than a digit, or a '-' right before one, separates
+// numbers; a number has at most 20 digits.
+struct ReadNumbers {
+	size_t count; // fewer than asked for at the end of the input, or on errors
+	enum Status { Ok, TooLarge, Failed } status;
+};
+ReadNumbers read_numbers(ProgramState &state, int fd, number_t *out, size_t n);
+#endif
+
+#ifndef KERNEL
+// Host primitives: native functions appended to a state's primitive table, found by
+// name and dispatched exactly like the built-in ones (words still shadow them).
+// desc starts with the stack effect, like the built-ins' ("a b -- c ; what it does"),
+// and name and desc have to outlive the state. A primitive checks its own stack, with
+// stack_has or the way the built-ins do. Words, images and modules refer to primitives
+// by index, so register the same ones in the same order before loading any of those.
+// Returns the new primitive's index, or nothing if name is taken, empty or has
+// spaces in it, or desc has no stack effect.
+maybe_t<idx_t> register_primitive(ProgramState &state, const char *name, const char *desc, void (*fun)(ProgramState&));
+// for host primitives: whether the stack holds at least n cells, setting an error if not
+inline bool stack_has(ProgramState &state, size_t n) {
+	if (length(state.stack) >= n) return true;
+	state.error = "Error: not enough values on the stack";
+	state.error_handled = false;
+	return false;
+}
+#endif
+
+#ifndef KERNEL
+// Binary cells: a file of raw cells (8 bytes each, in the host's byte order, which is
+// little-endian on every target this builds for) is read straight into the stack's
+// storage, and cells are written back out from it, with as few read and write calls
+// as the kernel allows. Both return false, with error (if given) saying why, and leave the stack
+// untouched on failure; load_cells sets count to the number of cells pushed.
+bool load_cells(Stack &stack, const char *path, size_t &count, const char **error = nullptr);
+bool dump_cells(const number_t *cells, size_t n, const char *path, const char **error = nullptr);
+#endif
+
+#ifndef KERNEL
+// FFI: defines a word named sym that calls the C function sym from the shared library lib
+// (opened with dlopen, so a bare name like "libm.so.6" is searched for the usual way).
+// args and rets are either a count of integer cells ("2", "0") or one letter per value:
+// i for a 64 bit integer (int64_t, long, size_t or a pointer), w for a 32 bit int (a result
+// is sign-extended from its low 32 bits), d for a double, converted from and to an integer cell. Arguments are taken with the last one on top.
+// At most FFI_MAX_INT_ARGS integers and FFI_MAX_DOUBLE_ARGS doubles, at most one result;
+// variadic functions and structs by value can't be called.
+// The library is opened and the symbol looked up once, here; libraries are never closed.
+// Bindings aren't saved with images; words refer to them by library, symbol and types, so words
+// using them fail after load_image until the same functions are bound again (in any order).
+// Returns the new word's index, or nothing with error (ready for ProgramState::error) set.
+maybe_t<idx_t> ffi_bind(ProgramState &state, const char *lib, const char *sym, const char *args, const char *rets, const char **error);
+#endif
+
+// turns tracing on or off; the ring is only allocated when tracing is first turned on,
+// so states that never trace don't pay for it. false if it couldn't be allocated
+bool trace_enable(ProgramState &state, bool enabled);
+
+#ifndef KERNEL
+// writes the last n trace records (at most TRACE_RING_SIZE) to a binary file,
+// together with the names needed to decode it without the original session
+bool trace_dump(const ProgramState &state, const char *path, size_t n = TRACE_RING_SIZE);
+// prints a file written by trace_dump in the same format as `def`
+bool trace_decode(const char *path);
+#endif
+
 enum PrimitiveWords {
 	PW_ShowStack,
 	PW_StackLen,
@@ -625,6 +984,60 @@ enum PrimitiveWords {
 	PW_Words,
 	PW_Guide,
 
+	PW_Trace,
+	PW_TraceShow,
+
+	PW_Profile,
+	PW_ProfileReset,
+	PW_ProfileReport,
+	PW_ProfilePerf,
+
+	PW_MemStats,
+
+	PW_SaveImage,
+
+	PW_ReadNum,
+	PW_ReadNums,
+	PW_LoadCells,
+	PW_DumpCells,
+
+	PW_SumN,
+	PW_ProdN,
+	PW_MinN,
+	PW_MaxN,
+	PW_AndN,
+	PW_OrN,
+	PW_XorN,
+	PW_CountEqN,
+	PW_AddN,
+	PW_SubN,
+	PW_MulN,
+	PW_ShlN,
+	PW_ShrN,
+	PW_CmpEqN,
+	PW_CmpLtN,
+	PW_AddNN,
+	PW_SubNN,
+	PW_MulNN,
+	PW_CmpEqNN,
+	PW_CmpLtNN,
+	PW_SortN,
+	PW_ReverseSortN,
+	PW_BsearchN,
+	PW_UniqN,
+	PW_ScanN,
+	PW_HistN,
+	PW_CompactN,
+
+	PW_Allot,
+	PW_Fetch,
+	PW_Store,
+	PW_CFetch,
+	PW_CStore,
+	PW_AddStore,
+	PW_Move,
+	PW_Fill,
+
 	PW_COUNT
 };
 
@@ -651,6 +1064,16 @@ enum SyntaxConstructions {
 	SC_Rep,
 	SC_Block,
 
+	SC_Time,
+	SC_PerfStat,
+	SC_AnnotatedDef,
+
+	SC_Include,
+
+	SC_Ffi,
+
+	SC_FilterN,
+
 	SC_COUNT
 };
 
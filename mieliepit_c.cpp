@@ -0,0 +1,203 @@
+#include <cstring>
+#include <new>
+
+#include "mieliepit.hpp"
+#include "mieliepit_c.h"
+
+using namespace mieliepit;
+
+static_assert(sizeof(mp_cell) == sizeof(number_t), "Expected cells to be 64 bits");
+
+// collects output and hands it to the callback a buffer at a time
+struct OutputBuf {
+	char buf[4096];
+	size_t len = 0;
+	mp_output_fn fn = nullptr;
+	void *user = nullptr;
+
+	void flush() {
+		if (fn && len) fn(user, buf, len);
+		len = 0;
+	}
+
+	// ProgramState::output
+	static void write(void *self, const char *data, size_t len) {
+		OutputBuf &out = *static_cast<OutputBuf *>(self);
+		if (out.len + len > sizeof(out.buf)) {
+			out.flush();
+			if (len > sizeof(out.buf)) {
+				if (out.fn) out.fn(out.user, data, len);
+				return;
+			}
+		}
+		memcpy(out.buf + out.len, data, len);
+		out.len += len;
+	}
+};
+
+struct mp_state {
+	ProgramState state { primitives, PW_COUNT, syntax, SC_COUNT };
+	OutputBuf output_buf {};
+	bool quit = false;
+	size_t error_offset = 0;
+};
+
+void mieliepit::quit_primitive_fn(ProgramState &state) {
+	static_cast<mp_state *>(state.host)->quit = true;
+}
+
+void mieliepit::guide_primitive_fn(ProgramState &state) {
+	state.output(state.output_user, guide_text, strlen(guide_text));
+}
+
+namespace {
+
+void reset_error(mp_state *mp) {
+	mp->state.error = nullptr;
+	mp->state.error_handled = false;
+	mp->quit = false;
+	mp->error_offset = 0;
+}
+
+mp_status finish(mp_state *mp) {
+	mp->output_buf.flush();
+	if (mp->state.error) return MP_ERROR;
+	return mp->quit ? MP_QUIT : MP_OK;
+}
+
+}
+
+extern "C" {
+
+mp_state *mp_state_new(void) {
+	mp_state *mp = new (std::nothrow) mp_state;
+	if (mp == nullptr) return nullptr;
+	mp->state.output = OutputBuf::write;
+	mp->state.output_user = &mp->output_buf;
+	mp->state.host = mp;
+	return mp;
+}
+
+void mp_state_free(mp_state *mp) {
+	delete mp;
+}
+
+void mp_set_output(mp_state *mp, mp_output_fn output, void *user) {
+	mp->output_buf.flush();
+	mp->output_buf.fn = output;
+	mp->output_buf.user = user;
+}
+
+mp_status mp_eval(mp_state *mp, const char *source, size_t len) {
+	reset_error(mp);
+	Interpreter interpreter {
+		.line = nullptr,
+		.len = 0,
+		.curr_word = {},
+		.state = mp->state,
+	};
+	interpreter.set_source(source, len);
+
+	try {
+		while (!mp->quit && !mp->state.error && interpreter.len > 0) {
+			interpreter.run_next();
+		}
+	} catch (const std::bad_alloc &) {
+		mp->output_buf.flush();
+		return MP_NO_MEMORY;
+	}
+
+	if (mp->state.error) {
+		const char *at = interpreter.curr_word.len ? interpreter.curr_word.text : interpreter.line;
+		mp->error_offset = at - source;
+	}
+	return finish(mp);
+}
+
+mp_status mp_load_image(mp_state *mp, const char *path) {
+	reset_error(mp);
+	const char *error;
+	try {
+		if (!load_image(mp->state, path, &error)) mp->state.error = error;
+	} catch (const std::bad_alloc &) {
+		return MP_NO_MEMORY;
+	}
+	return finish(mp);
+}
+
+const char *mp_error(const mp_state *mp) {
+	return mp->state.error;
+}
+
+size_t mp_error_offset(const mp_state *mp) {
+	return mp->error_offset;
+}
+
+mp_status mp_find_word(const mp_state *mp, const char *name, size_t len, mp_word *word) {
+	const ProgramState &state = mp->state;
+
+	// later words shadow earlier ones, and words shadow primitives, like in source code
+	idx_t i = length(state.words);
+	while (i --> 0) {
+		if (strlen(state.words[i].name) == len && strncmp(state.words[i].name, name, len) == 0) {
+			*word = { .kind = MP_WORD_KIND_WORD, .index = i };
+			return MP_OK;
+		}
+	}
+	i = state.primitives_len;
+	while (i --> 0) {
+		if (strlen(state.primitives[i].name) == len && strncmp(state.primitives[i].name, name, len) == 0) {
+			*word = { .kind = MP_WORD_KIND_PRIMITIVE, .index = i };
+			return MP_OK;
+		}
+	}
+	return MP_NOT_FOUND;
+}
+
+mp_status mp_call_word(mp_state *mp, mp_word word) {
+	Value value;
+	if (word.kind == MP_WORD_KIND_WORD && word.index < length(mp->state.words)) {
+		value = { .type = Value::Word, .word_idx = word.index };
+	} else if (word.kind == MP_WORD_KIND_PRIMITIVE && word.index < mp->state.primitives_len) {
+		value = { .type = Value::Primitive, .primitive_idx = word.index };
+	} else {
+		return MP_BAD_WORD;
+	}
+
+	reset_error(mp);
+	Interpreter interpreter {
+		.line = nullptr,
+		.len = 0,
+		.curr_word = {},
+		.state = mp->state,
+	};
+	try {
+		interpreter.run_value(value);
+	} catch (const std::bad_alloc &) {
+		mp->output_buf.flush();
+		return MP_NO_MEMORY;
+	}
+	return finish(mp);
+}
+
+mp_status mp_push(mp_state *mp, mp_cell cell) {
+	try {
+		push(mp->state.stack, { .sign = cell });
+	} catch (const std::bad_alloc &) {
+		return MP_NO_MEMORY;
+	}
+	return MP_OK;
+}
+
+mp_status mp_pop(mp_state *mp, mp_cell *cell) {
+	if (length(mp->state.stack) == 0) return MP_EMPTY;
+	*cell = pop(mp->state.stack).sign;
+	return MP_OK;
+}
+
+const mp_cell *mp_stack_view(const mp_state *mp, size_t *len) {
+	*len = length(mp->state.stack);
+	return reinterpret_cast<const mp_cell *>(mp->state.stack.data());
+}
+
+}
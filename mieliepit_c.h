@@ -0,0 +1,88 @@
+#ifndef MIELIEPIT_C_H
+#define MIELIEPIT_C_H
+
+/*
+ * C API for embedding the interpreter (hosted builds only).
+ *
+ * Every interpreter is an mp_state of its own, with its own words, memory,
+ * input buffers (read_num, read_nums) and ffi bindings, so separate states
+ * can be used from separate threads (but one state only from one thread at
+ * a time). The one exception is the hardware counters behind perf_stat and
+ * profile_perf: they are opened once per process, for the thread that used
+ * them first, so only use those from one state. Nothing here throws, and
+ * what programs print only goes to the state's output callback (the interpreter
+ * writes through ProgramState::output, never to a stream of its own).
+ *
+ * Link with mieliepit_c.cpp and the mieliepit*.cpp files (see build_library.sh).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mp_state mp_state;
+
+/* a stack cell */
+typedef int64_t mp_cell;
+
+/* what an mp_word refers to, its kind */
+typedef enum mp_word_kind {
+	MP_WORD_KIND_WORD = 1,
+	MP_WORD_KIND_PRIMITIVE = 2,
+} mp_word_kind;
+
+/* a word or primitive looked up by mp_find_word, to be run by mp_call_word;
+   stays valid for the state it came from until mp_load_image replaces its words */
+typedef struct mp_word {
+	uint64_t kind;
+	uint64_t index;
+} mp_word;
+
+typedef enum mp_status {
+	MP_OK = 0,
+	MP_ERROR = 1,     /* the program failed, see mp_error */
+	MP_QUIT = 2,      /* the program ran `quit` */
+	MP_EMPTY = 3,     /* mp_pop on an empty stack */
+	MP_NOT_FOUND = 4, /* mp_find_word found nothing by that name */
+	MP_BAD_WORD = 5,  /* mp_call_word got a handle that isn't valid for this state */
+	MP_NO_MEMORY = 6,
+} mp_status;
+
+/* receives everything the program prints, in pieces of any size */
+typedef void (*mp_output_fn)(void *user, const char *data, size_t len);
+
+/* a state with only the primitives and syntax items; load words with mp_eval or mp_load_image.
+   output goes nowhere until mp_set_output. returns NULL if out of memory */
+mp_state *mp_state_new(void);
+void mp_state_free(mp_state *state);
+
+/* output is buffered and handed to output before every mp_eval and mp_call_word returns */
+void mp_set_output(mp_state *state, mp_output_fn output, void *user);
+
+/* runs source code; definitions, comments and blocks can span lines */
+mp_status mp_eval(mp_state *state, const char *source, size_t len);
+/* replaces all words with those in an image written by save_image */
+mp_status mp_load_image(mp_state *state, const char *path);
+
+/* the message of the last MP_ERROR, or NULL if the last call succeeded */
+const char *mp_error(const mp_state *state);
+/* for an MP_ERROR from mp_eval, the offset in source of the word that failed;
+   0 after any other call */
+size_t mp_error_offset(const mp_state *state);
+
+mp_status mp_find_word(const mp_state *state, const char *name, size_t len, mp_word *word);
+mp_status mp_call_word(mp_state *state, mp_word word);
+
+mp_status mp_push(mp_state *state, mp_cell cell);
+mp_status mp_pop(mp_state *state, mp_cell *cell);
+/* the stack, bottom first; valid until the next call that changes the stack */
+const mp_cell *mp_stack_view(const mp_state *state, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <dlfcn.h>
+
+#include "./mieliepit.hpp"
+#include "./mieliepit_internal.hpp"
+
+namespace mieliepit {
+
+/*** SECTION: FFI ***/
+
+namespace {
+
+// every bound function is called as if it took 6 integers and 8 doubles: on x86-64 and
+// arm64 those are all passed in registers, integers and doubles in separate ones, so a
+// function taking fewer of either just never looks at the rest
+using FfiIntFun = int64_t (*)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t,
+	double, double, double, double, double, double, double, double);
+using FfiDoubleFun = double (*)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t,
+	double, double, double, double, double, double, double, double);
+
+// "2" -> "ii", "dwd" -> "dwd"; false if neither or too long
+bool ffi_parse_types(const char *spec, char *out, size_t max_len) {
+	size_t len = 0;
+	if (*spec >= '0' && *spec <= '9') {
+		char *end;
+		const unsigned long count = strtoul(spec, &end, 10);
+		if (*end != 0 || count > max_len) return false;
+		for (; len < count; ++len) out[len] = 'i';
+	} else {
+		for (; spec[len]; ++len) {
+			if (len == max_len || (spec[len] != 'i' && spec[len] != 'w' && spec[len] != 'd')) return false;
+			out[len] = spec[len];
+		}
+	}
+	out[len] = 0;
+	return true;
+}
+
+}
+
+// calls the function bound by `ffi`, its binding's key and (below that) index on top of the arguments
+RawFunction ffi_call_rf = { "<internal:ffi_call>", [](Runner &runner) {
+	ProgramState &state = runner.state;
+	const uint64_t key = pop(state.stack).pos;
+	const uint64_t idx = pop(state.stack).pos;
+	// the key covers the types too, so a function bound differently in this session isn't called;
+	// the index is only stale for words from an image or another session, which look it up by key
+	const FfiBinding *found = idx < state.ffi.size() && state.ffi[idx].key == key ? &state.ffi[idx] : nullptr;
+	if (found == nullptr) {
+		for (const FfiBinding &binding : state.ffi) {
+			if (binding.key == key) {
+				found = &binding;
+				break;
+			}
+		}
+	}
+	if (found == nullptr) {
+		state.error = "Error: the C function this word calls is not bound in this session";
+		state.error_handled = false;
+		return;
+	}
+	const FfiBinding &binding = *found;
+
+	const size_t args_len = binding.args_len;
+	if (length(state.stack) < args_len) {
+		state.error = "Error: not enough values on the stack";
+		state.error_handled = false;
+		return;
+	}
+	int64_t ints[FFI_MAX_INT_ARGS] = {};
+	double doubles[FFI_MAX_DOUBLE_ARGS] = {};
+	size_t ints_len = 0, doubles_len = 0;
+	const number_t *args = args_len ? &stack_peek(state.stack, args_len - 1) : nullptr;
+	for (size_t i = 0; i < args_len; ++i) {
+		if (binding.args[i] == 'd') doubles[doubles_len++] = (double)args[i].sign;
+		else ints[ints_len++] = args[i].sign;
+	}
+	for (size_t i = 0; i < args_len; ++i) pop(state.stack);
+
+#define FFI_ARGS ints[0], ints[1], ints[2], ints[3], ints[4], ints[5], \
+	doubles[0], doubles[1], doubles[2], doubles[3], doubles[4], doubles[5], doubles[6], doubles[7]
+	if (binding.ret == 'd') {
+		const double result = ((FfiDoubleFun)binding.fun)(FFI_ARGS);
+		// converting NaN or anything out of range is undefined, so those are pinned
+		const int64_t cell = result != result ? 0
+			: result >= 0x1p63 ? INT64_MAX
+			: result < -0x1p63 ? INT64_MIN
+			: (int64_t)result;
+		push(state.stack, { .sign = cell });
+	} else if (binding.ret == 'i') {
+		push(state.stack, { .sign = ((FfiIntFun)binding.fun)(FFI_ARGS) });
+	} else if (binding.ret == 'w') {
+		// only the low 32 bits of the register are the result, the rest is whatever was there
+		push(state.stack, { .sign = (int32_t)((FfiIntFun)binding.fun)(FFI_ARGS) });
+	} else {
+		((FfiIntFun)binding.fun)(FFI_ARGS);
+	}
+	note_stack_depth(state);
+#undef FFI_ARGS
+} };
+
+maybe_t<idx_t> ffi_bind(ProgramState &state, const char *lib, const char *sym, const char *args, const char *rets, const char **error) {
+#if !defined(__x86_64__) && !defined(__aarch64__)
+	*error = "Error: ffi is not supported on this platform";
+	return {};
+#else
+	FfiBinding binding = {};
+	char ret[2];
+	if (!ffi_parse_types(args, binding.args, FFI_MAX_INT_ARGS + FFI_MAX_DOUBLE_ARGS)
+		|| (ptrdiff_t)strlen(binding.args) - std::count(binding.args, binding.args + strlen(binding.args), 'd') > (ptrdiff_t)FFI_MAX_INT_ARGS
+		|| std::count(binding.args, binding.args + strlen(binding.args), 'd') > (ptrdiff_t)FFI_MAX_DOUBLE_ARGS) {
+		*error = "Error: ffi arguments are a count of up to 6 integers, or up to 6 i or w and 8 d letters";
+		return {};
+	}
+	if (!ffi_parse_types(rets, ret, 1)) {
+		*error = "Error: ffi results are 0, 1, i, w or d";
+		return {};
+	}
+	binding.args_len = strlen(binding.args);
+	binding.ret = ret[0];
+	binding.key = FNV1A_INIT;
+	for (const char *part : { lib, sym, (const char *)binding.args, (const char *)ret }) {
+		binding.key = fnv1a(binding.key, part, strlen(part) + 1);
+	}
+
+	// the handle is kept open for good, as words may call into the library at any time
+	void *handle = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+	if (handle == nullptr) {
+		state.ffi_error = "Error: ffi could not open the library: ";
+		state.ffi_error += dlerror();
+		*error = state.ffi_error.c_str();
+		return {};
+	}
+	dlerror();
+	binding.fun = dlsym(handle, sym);
+	if (binding.fun == nullptr) {
+		const char *reason = dlerror();
+		state.ffi_error = "Error: ffi could not find the symbol in the library: ";
+		state.ffi_error += reason ? reason : "the symbol is null";
+		*error = state.ffi_error.c_str();
+		dlclose(handle);
+		return {};
+	}
+
+	// "i d -- d ; calls pow from libm.so.6"
+	std::string desc;
+	for (const char *arg = binding.args; *arg; ++arg) {
+		desc += *arg;
+		desc += ' ';
+	}
+	desc += "--";
+	if (binding.ret) {
+		desc += ' ';
+		desc += binding.ret;
+	}
+	desc += " ; calls ";
+	desc += sym;
+	desc += " from ";
+	desc += lib;
+
+	// binding the same function again only defines another word for it
+	idx_t idx = 0;
+	while (idx < state.ffi.size() && state.ffi[idx].key != binding.key) ++idx;
+	if (idx == state.ffi.size()) state.ffi.push_back(binding);
+
+	const idx_t code_pos = length(state.code);
+	push(state.code, { .type = Value::Number, .number = { .pos = idx } });
+	push(state.code, { .type = Value::Number, .number = { .pos = binding.key } });
+	push(state.code, { .type = Value::RawFunction, .function_ptr = &ffi_call_rf });
+	state.define_word(sym, strlen(sym), desc.c_str(), desc.size(), code_pos, 3);
+	return length(state.words) - 1;
+#endif
+}
+
+}
@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "./mieliepit.hpp"
+#include "./mieliepit_internal.hpp"
+
+namespace mieliepit {
+
+/*** SECTION: Images ***/
+
+namespace {
+
+constexpr char IMAGE_MAGIC[8] = { 'M', 'P', 'I', 'M', 'A', 'G', 'E', '1' };
+constexpr uint64_t IMAGE_VERSION = 1;
+constexpr size_t IMAGE_HEADER_SIZE = sizeof(IMAGE_MAGIC) + 7 * sizeof(uint64_t);
+
+uint64_t image_u64(const uint8_t *at) {
+	uint64_t n;
+	memcpy(&n, at, sizeof(n));
+	return n;
+}
+
+}
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= ((const uint8_t *)data)[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+// code in an image refers to primitives, syntax items and raw functions by index,
+// so an image only fits the exact tables it was made with
+uint64_t image_tables_checksum(const ProgramState &state) {
+	uint64_t hash = FNV1A_INIT;
+	auto add_str = [&](const char *str) { hash = fnv1a(hash, str, strlen(str) + 1); };
+
+	hash = fnv1a(hash, &state.primitives_len, sizeof(state.primitives_len));
+	for (size_t i = 0; i < state.primitives_len; ++i) {
+		add_str(state.primitives[i].name);
+		add_str(state.primitives[i].desc);
+	}
+	hash = fnv1a(hash, &state.syntax_len, sizeof(state.syntax_len));
+	for (size_t i = 0; i < state.syntax_len; ++i) add_str(state.syntax[i].name);
+	for (size_t i = 0; i < RAW_FUNCTIONS_LEN; ++i) add_str(raw_functions[i]->name);
+
+	return hash;
+}
+
+void write_u64(std::ostream &out, uint64_t n) {
+	out.write((const char *)&n, sizeof(n));
+}
+void write_str(std::ostream &out, const char *str) {
+	const uint64_t len = strlen(str);
+	write_u64(out, len);
+	out.write(str, len);
+}
+bool read_u64(std::istream &in, uint64_t &n) {
+	return static_cast<bool>(in.read((char *)&n, sizeof(n)));
+}
+bool read_str(std::istream &in, std::string &str) {
+	uint64_t len;
+	if (!read_u64(in, len) || len > (1 << 20)) return false;
+	str.resize(len);
+	return static_cast<bool>(in.read(str.data(), len));
+}
+
+// File layout, all integers are host-endian u64:
+//   magic, version, tables checksum, payload checksum,
+//   word count, code length, names length, descriptions length,
+//   then the payload:
+//   (name offset, description offset, code_pos, code_len) per word,
+//   (type, payload) per code cell, the names buffer, the descriptions buffer.
+// Raw function payloads are indices into raw_functions.
+bool save_image(const ProgramState &state, const char *path) {
+	std::string payload;
+	auto add_u64 = [&](uint64_t n) { payload.append((const char *)&n, sizeof(n)); };
+
+	const char *names = *state.word_names_buf.first;
+	const char *descs = *state.word_descs_buf.first;
+	for (idx_t i = 0; i < length(state.words); ++i) {
+		const Word &word = state.words[i];
+		add_u64(word.name - names);
+		add_u64(word.desc - descs);
+		add_u64(word.code_pos);
+		add_u64(word.code_len);
+	}
+	for (idx_t i = 0; i < length(state.code); ++i) {
+		const Value value = state.code[i];
+		add_u64(value.type);
+		if (value.type == Value::RawFunction) {
+			const auto found = std::find(raw_functions, raw_functions + RAW_FUNCTIONS_LEN, value.function_ptr);
+			assert(found != raw_functions + RAW_FUNCTIONS_LEN && "raw function missing from raw_functions");
+			add_u64(found - raw_functions);
+		} else {
+			add_u64(value.raw_value);
+		}
+	}
+	payload.append(names, state.word_names_buf.second);
+	payload.append(descs, state.word_descs_buf.second);
+
+	std::ofstream out(path, std::ios::binary);
+	if (!out) return false;
+
+	out.write(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	write_u64(out, IMAGE_VERSION);
+	write_u64(out, image_tables_checksum(state));
+	write_u64(out, fnv1a(FNV1A_INIT, payload.data(), payload.size()));
+	write_u64(out, length(state.words));
+	write_u64(out, length(state.code));
+	write_u64(out, state.word_names_buf.second);
+	write_u64(out, state.word_descs_buf.second);
+	out.write(payload.data(), payload.size());
+
+	return static_cast<bool>(out);
+}
+
+bool load_image(ProgramState &state, const char *path, const char **error) {
+	const char *ignored;
+	if (error == nullptr) error = &ignored;
+
+	const int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		*error = "could not open the image";
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < IMAGE_HEADER_SIZE) {
+		close(fd);
+		*error = "not a mieliepit image";
+		return false;
+	}
+	const size_t size = st.st_size;
+	void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		*error = "could not map the image";
+		return false;
+	}
+
+	// checks everything before touching the state, so a bad image leaves it as it was
+	auto load = [&]() -> const char * {
+		const uint8_t *data = (const uint8_t *)mapping;
+		if (memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) return "not a mieliepit image";
+		const uint8_t *header = data + sizeof(IMAGE_MAGIC);
+		if (image_u64(header) != IMAGE_VERSION) return "unsupported image version";
+		if (image_u64(header + 8) != image_tables_checksum(state)) {
+			return "image was made with different primitives or syntax";
+		}
+
+		const uint64_t words_len = image_u64(header + 24);
+		const uint64_t code_len = image_u64(header + 32);
+		const uint64_t names_len = image_u64(header + 40);
+		const uint64_t descs_len = image_u64(header + 48);
+		if (names_len > WORD_NAMES_BUF_SIZE || descs_len > WORD_DESCS_BUF_SIZE) return "image doesn't fit";
+		if (words_len > size || code_len > size) return "image is truncated";
+		const size_t payload_size = words_len * 32 + code_len * 16 + names_len + descs_len;
+		if (size - IMAGE_HEADER_SIZE != payload_size) return "image is truncated";
+
+		const uint8_t *payload = data + IMAGE_HEADER_SIZE;
+		if (image_u64(header + 16) != fnv1a(FNV1A_INIT, payload, payload_size)) return "image is corrupted";
+
+		const uint8_t *words = payload;
+		const uint8_t *code = words + words_len * 32;
+		const char *names = (const char *)(code + code_len * 16);
+		const char *descs = names + names_len;
+
+		for (uint64_t i = 0; i < words_len; ++i) {
+			const uint8_t *word = words + i * 32;
+			const uint64_t name = image_u64(word), desc = image_u64(word + 8);
+			const uint64_t code_pos = image_u64(word + 16), len = image_u64(word + 24);
+			if (name >= names_len || desc >= descs_len) return "image is corrupted";
+			if (code_pos > code_len || len > code_len - code_pos) return "image is corrupted";
+		}
+		for (uint64_t i = 0; i < code_len; ++i) {
+			const uint64_t type = image_u64(code + i * 16), payload = image_u64(code + i * 16 + 8);
+			const bool valid =
+				(type == Value::Word && payload < words_len)
+				|| (type == Value::Primitive && payload < state.primitives_len)
+				|| (type == Value::Number)
+				|| (type == Value::RawFunction && payload < RAW_FUNCTIONS_LEN);
+			if (!valid) return "image is corrupted";
+		}
+		if ((names_len && names[names_len-1] != 0) || (descs_len && descs[descs_len-1] != 0)) {
+			return "image is corrupted";
+		}
+
+		// the image replaces everything that was defined before
+		state.words.clear();
+		state.code.clear();
+		memcpy(*state.word_names_buf.first, names, names_len);
+		state.word_names_buf.second = names_len;
+		memcpy(*state.word_descs_buf.first, descs, descs_len);
+		state.word_descs_buf.second = descs_len;
+
+		for (uint64_t i = 0; i < words_len; ++i) {
+			const uint8_t *word = words + i * 32;
+			push(state.words, Word {
+				.name = *state.word_names_buf.first + image_u64(word),
+				.desc = *state.word_descs_buf.first + image_u64(word + 8),
+				.code_pos = image_u64(word + 16),
+				.code_len = image_u64(word + 24),
+			});
+		}
+		for (uint64_t i = 0; i < code_len; ++i) {
+			const uint64_t type = image_u64(code + i * 16), payload = image_u64(code + i * 16 + 8);
+			Value value = { .type = (Value::Type)type, .raw_value = payload };
+			if (type == Value::RawFunction) value.function_ptr = raw_functions[payload];
+			push(state.code, value);
+		}
+
+		return nullptr;
+	};
+
+	*error = load();
+	munmap(mapping, size);
+	if (*error != nullptr) return false;
+
+	// nothing that describes the old words applies to the new ones
+	state.modules.clear();
+#ifdef MIELIEPIT_PROFILE
+	profile_reset(state.profile);
+#endif
+	native_symbols_forget(state);
+	return true;
+}
+
+void copy_words(ProgramState &to, const ProgramState &from) {
+	assert(to.syntax == from.syntax);
+
+	// host primitives come along, so code calling them means the same in both
+	if (!from.own_primitives.empty()) {
+		to.own_primitives = from.own_primitives;
+		to.primitives = to.own_primitives.data();
+		to.primitives_len = to.own_primitives.size();
+	}
+	assert(to.primitives_len == from.primitives_len);
+
+	memcpy(*to.word_names_buf.first, *from.word_names_buf.first, from.word_names_buf.second);
+	to.word_names_buf.second = from.word_names_buf.second;
+	memcpy(*to.word_descs_buf.first, *from.word_descs_buf.first, from.word_descs_buf.second);
+	to.word_descs_buf.second = from.word_descs_buf.second;
+
+	// names and descriptions point into the buffers, so they move with them
+	to.words.clear();
+	for (const Word &word : from.words) {
+		push(to.words, Word {
+			.name = *to.word_names_buf.first + (word.name - *from.word_names_buf.first),
+			.desc = *to.word_descs_buf.first + (word.desc - *from.word_descs_buf.first),
+			.code_pos = word.code_pos,
+			.code_len = word.code_len,
+		});
+	}
+	to.code = from.code;
+	to.modules = from.modules;
+	to.ffi = from.ffi;
+	to.heap = from.heap;
+}
+
+/*** SECTION: Source files ***/
+
+maybe_t<SourceView> map_source(const char *path, const char **error) {
+	const char *ignored;
+	if (error == nullptr) error = &ignored;
+
+	const int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		*error = "could not open the file";
+		return {};
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		*error = "not a regular file";
+		return {};
+	}
+	// an empty mapping isn't allowed, and there is nothing to read anyways
+	if (st.st_size == 0) {
+		close(fd);
+		return SourceView { .data = "", .len = 0 };
+	}
+
+	const size_t size = st.st_size;
+	void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		*error = "could not map the file";
+		return {};
+	}
+	madvise(mapping, size, MADV_SEQUENTIAL);
+
+	return SourceView { .data = (const char *)mapping, .len = size };
+}
+
+void release_source_before(const SourceView &source, const char *pos) {
+	if (source.len == 0) return;
+
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	const size_t len = (size_t)(pos - source.data) / page_size * page_size;
+	if (len) madvise((void *)source.data, len, MADV_DONTNEED);
+}
+
+void unmap_source(const SourceView &source) {
+	if (source.len) munmap((void *)source.data, source.len);
+}
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+// What mieliepit.cpp shares with the hosted-only parts of the library in the
+// other mieliepit_*.cpp files (images and modules, trace dumps, the sampling
+// profiler, native profiler symbols, hardware counters and ffi), which are kept
+// apart so that the interpreter's file is only about running code.
+// None of this is part of the API.
+
+#ifndef KERNEL
+#include <iosfwd>
+#include <string>
+#endif
+
+#include "./mieliepit.hpp"
+
+namespace mieliepit {
+
+// everything printed goes through these, see ProgramState::output
+void writestring(const ProgramState &state, const char *str);
+void writestringl(const ProgramState &state, const char *str);
+void writechar(const ProgramState &state, char ch);
+// right-aligns n in a field of the given width
+void writenum_padded(const ProgramState &state, uint64_t n, size_t width);
+void writenum_signed(const ProgramState &state, int64_t n);
+// left-aligns str in a field of the given width
+void writestring_padded(const ProgramState &state, const char *str, size_t width);
+
+// the deepest the stack has been, for mem_stats. it is kept where the stack
+// grows rather than after every step, so whatever pushes more than it pops
+// calls this after its pushes
+inline void note_stack_depth(ProgramState &state) {
+	if (length(state.stack) > state.stack_high_water) state.stack_high_water = length(state.stack);
+}
+
+uint64_t clock_ns();
+uint64_t clock_cycles();
+
+void run_word_code(ProgramState *state_ptr, idx_t word_idx);
+
+#ifdef MIELIEPIT_PROFILE
+void profile_reset(Profile &profile);
+#endif
+
+// mieliepit.cpp
+extern RawFunction *const raw_functions[];
+extern const size_t RAW_FUNCTIONS_LEN;
+// calls the function bound by `ffi`, see ffi_bind
+extern RawFunction ffi_call_rf;
+
+bool is_word_number(const ProgramState &state, idx_t begin, idx_t i, idx_t end);
+
+#ifndef KERNEL
+// mieliepit_image.cpp
+constexpr uint64_t FNV1A_INIT = 0xcbf29ce484222325;
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len);
+uint64_t image_tables_checksum(const ProgramState &state);
+
+// host-endian integers and length-prefixed strings, for images, modules and trace dumps
+void write_u64(std::ostream &out, uint64_t n);
+void write_str(std::ostream &out, const char *str);
+bool read_u64(std::istream &in, uint64_t &n);
+bool read_str(std::istream &in, std::string &str);
+
+// mieliepit_native.cpp
+#ifdef MIELIEPIT_PROFILE
+void run_word_via_trampoline(idx_t word_idx, ProgramState &state);
+#endif
+void native_symbols_forget(const ProgramState &state);
+#endif
+
+}
@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "./mieliepit.hpp"
+#include "./mieliepit_internal.hpp"
+
+namespace mieliepit {
+
+/*** SECTION: Modules ***/
+
+namespace {
+
+constexpr char MODULE_MAGIC[8] = { 'M', 'P', 'M', 'O', 'D', 'U', 'L', '1' };
+constexpr uint64_t MODULE_VERSION = 1;
+constexpr size_t MODULE_MAX_DEPTH = 64;
+
+// A module object holds what a module defined, in order: the words it defined and
+// the modules it included. Word references (also the word indices `help`, `def` and
+// `adef` compile into numbers) are kept by name and looked up again on loading, which
+// finds the same words compiling the source again would. An empty name refers to the
+// word being defined.
+enum ModuleEntryKind : uint64_t {
+	ME_Include,
+	ME_Word,
+};
+enum ModuleCellKind : uint64_t {
+	MC_Word,
+	MC_WordNumber,
+	MC_Primitive,
+	MC_Number,
+	MC_RawFunction,
+};
+
+struct ModuleCell {
+	uint64_t kind;
+	uint64_t payload;
+	std::string name;
+};
+struct ModuleEntry {
+	uint64_t kind;
+	std::string name; // word name or included path
+	std::string desc;
+	uint64_t key; // of the included module
+	std::vector<ModuleCell> cells;
+};
+struct ModuleObject {
+	uint64_t source_hash;
+	std::vector<ModuleEntry> entries;
+};
+
+// everything include_module may add to, so a failed cache load can be undone
+struct DictionaryMark {
+	size_t words, code, names, descs, modules;
+};
+
+DictionaryMark dictionary_mark(const ProgramState &state) {
+	return {
+		.words = length(state.words),
+		.code = length(state.code),
+		.names = state.word_names_buf.second,
+		.descs = state.word_descs_buf.second,
+		.modules = state.modules.size(),
+	};
+}
+void dictionary_restore(ProgramState &state, const DictionaryMark &mark) {
+	state.words.resize(mark.words);
+	state.code.resize(mark.code);
+	state.word_names_buf.second = mark.names;
+	state.word_descs_buf.second = mark.descs;
+	state.modules.resize(mark.modules);
+}
+
+maybe_t<uint64_t> source_hash(const std::string &path) {
+	const auto source = map_source(path.c_str());
+	if (!has(source)) return {};
+	const uint64_t hash = fnv1a(FNV1A_INIT, get(source).data, get(source).len);
+	unmap_source(get(source));
+	return hash;
+}
+
+std::string module_object_path(const ProgramState &state, const std::string &path) {
+	static const char digits[] = "0123456789abcdef";
+	const uint64_t hash = fnv1a(FNV1A_INIT, path.data(), path.size());
+	std::string res = state.module_cache_dir + "/";
+	for (int shift = 60; shift >= 0; shift -= 4) res += digits[(hash >> shift) & 0xf];
+	return res + ".mpmod";
+}
+
+maybe_t<idx_t> find_word(const ProgramState &state, const std::string &name) {
+	idx_t i = length(state.words);
+	while (i --> 0) {
+		if (name == state.words[i].name) return i;
+	}
+	return {};
+}
+
+// File layout, all integers are host-endian u64, strings are a length and the bytes:
+//   magic, version, tables checksum, source hash, path, entry count,
+//   then per entry its kind and either the included path and its key,
+//   or the word's name, description, cell count and (kind, payload or name) per cell.
+bool write_module_object(const ProgramState &state, const Module &module, uint64_t hash) {
+	std::ostringstream out;
+	out.write(MODULE_MAGIC, sizeof(MODULE_MAGIC));
+	write_u64(out, MODULE_VERSION);
+	write_u64(out, image_tables_checksum(state));
+	write_u64(out, hash);
+	write_str(out, module.path.c_str());
+
+	std::ostringstream entries;
+	size_t entry_count = 0;
+	auto add_word = [&](idx_t word_idx) {
+		const Word &word = state.words[word_idx];
+		write_u64(entries, ME_Word);
+		write_str(entries, word.name);
+		write_str(entries, word.desc);
+		write_u64(entries, word.code_len);
+
+		const idx_t begin = word.code_pos, end = word.code_pos + word.code_len;
+		for (idx_t i = begin; i < end; ++i) {
+			const Value value = state.code[i];
+			const bool word_number = is_word_number(state, begin, i, end);
+			if (value.type == Value::Word || word_number) {
+				const idx_t target = word_number ? value.number.pos : value.word_idx;
+				write_u64(entries, word_number ? MC_WordNumber : MC_Word);
+				write_str(entries, target == word_idx ? "" : state.words[target].name);
+			} else if (value.type == Value::RawFunction) {
+				const auto found = std::find(raw_functions, raw_functions + RAW_FUNCTIONS_LEN, value.function_ptr);
+				assert(found != raw_functions + RAW_FUNCTIONS_LEN && "raw function missing from raw_functions");
+				write_u64(entries, MC_RawFunction);
+				write_u64(entries, found - raw_functions);
+			} else if (value.type == Value::Primitive) {
+				write_u64(entries, MC_Primitive);
+				write_u64(entries, value.primitive_idx);
+			} else {
+				write_u64(entries, MC_Number);
+				write_u64(entries, value.number.pos);
+			}
+		}
+		++entry_count;
+	};
+
+	idx_t word_idx = module.words_begin;
+	for (const auto &include : module.includes) {
+		while (word_idx < include.at_word) add_word(word_idx++);
+		const Module &included = state.modules[include.module];
+		write_u64(entries, ME_Include);
+		write_str(entries, included.path.c_str());
+		write_u64(entries, included.key);
+		++entry_count;
+		word_idx += include.words;
+	}
+	while (word_idx < length(state.words)) add_word(word_idx++);
+
+	write_u64(out, entry_count);
+	out << entries.str();
+
+	// written next to the final name and then moved over it,
+	// so a concurrent session never reads half an object
+	std::error_code ec;
+	std::filesystem::create_directories(state.module_cache_dir, ec);
+	const std::string path = module_object_path(state, module.path);
+	const std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+	{
+		std::ofstream file(tmp_path, std::ios::binary);
+		if (!file || !(file << out.str())) return false;
+	}
+	std::filesystem::rename(tmp_path, path, ec);
+	return !ec;
+}
+
+maybe_t<ModuleObject> read_module_object(const ProgramState &state, const std::string &path) {
+	std::ifstream in(module_object_path(state, path), std::ios::binary);
+	if (!in) return {};
+
+	char magic[sizeof(MODULE_MAGIC)];
+	uint64_t version, checksum, entry_count;
+	std::string stored_path;
+	ModuleObject object;
+	if (!in.read(magic, sizeof(magic)) || memcmp(magic, MODULE_MAGIC, sizeof(magic)) != 0) return {};
+	if (!read_u64(in, version) || version != MODULE_VERSION) return {};
+	if (!read_u64(in, checksum) || checksum != image_tables_checksum(state)) return {};
+	if (!read_u64(in, object.source_hash) || !read_str(in, stored_path) || stored_path != path) return {};
+	if (!read_u64(in, entry_count)) return {};
+
+	for (uint64_t i = 0; i < entry_count; ++i) {
+		ModuleEntry entry {};
+		if (!read_u64(in, entry.kind)) return {};
+		if (entry.kind == ME_Include) {
+			if (!read_str(in, entry.name) || !read_u64(in, entry.key)) return {};
+		} else if (entry.kind == ME_Word) {
+			uint64_t cell_count;
+			if (!read_str(in, entry.name) || entry.name.empty() || !read_str(in, entry.desc)) return {};
+			if (!read_u64(in, cell_count) || cell_count > (1 << 20)) return {};
+			for (uint64_t j = 0; j < cell_count; ++j) {
+				ModuleCell cell {};
+				if (!read_u64(in, cell.kind)) return {};
+				const bool by_name = cell.kind == MC_Word || cell.kind == MC_WordNumber;
+				if (by_name ? !read_str(in, cell.name) : !read_u64(in, cell.payload)) return {};
+				if (cell.kind > MC_RawFunction) return {};
+				if (cell.kind == MC_Primitive && cell.payload >= state.primitives_len) return {};
+				if (cell.kind == MC_RawFunction && cell.payload >= RAW_FUNCTIONS_LEN) return {};
+				entry.cells.push_back(cell);
+			}
+		} else {
+			return {};
+		}
+		object.entries.push_back(entry);
+	}
+
+	return object;
+}
+
+// the key the module would get if it were included now, if it can come from the cache
+maybe_t<uint64_t> cached_module_key(const ProgramState &state, const std::string &path, size_t depth) {
+	for (const Module &module : state.modules) {
+		if (module.path == path) {
+			if (module.open) return {};
+			return module.key;
+		}
+	}
+	if (depth > MODULE_MAX_DEPTH) return {};
+
+	const auto hash = source_hash(path);
+	const auto object = read_module_object(state, path);
+	if (!has(hash) || !has(object) || get(object).source_hash != get(hash)) return {};
+
+	uint64_t key = get(hash);
+	for (const ModuleEntry &entry : get(object).entries) {
+		if (entry.kind != ME_Include) continue;
+		const auto included_key = cached_module_key(state, entry.name, depth + 1);
+		if (!has(included_key) || get(included_key) != entry.key) return {};
+		key = fnv1a(key, &entry.key, sizeof(entry.key));
+	}
+	return key;
+}
+
+void include_module(ProgramState &state, const std::string &path);
+
+// defines the object's words again, resolving their references by name;
+// returns false (with the state possibly half-changed) if that fails
+bool load_module_object(ProgramState &state, const ModuleObject &object) {
+	for (const ModuleEntry &entry : object.entries) {
+		if (entry.kind == ME_Include) {
+			include_module(state, entry.name);
+			if (state.error) return false;
+			continue;
+		}
+
+		if (state.word_names_buf.second + entry.name.size() + 1 > WORD_NAMES_BUF_SIZE) return false;
+		if (state.word_descs_buf.second + entry.desc.size() + 1 > WORD_DESCS_BUF_SIZE) return false;
+
+		const idx_t self = length(state.words);
+		const idx_t code_pos = length(state.code);
+		for (const ModuleCell &cell : entry.cells) {
+			switch (cell.kind) {
+				case MC_Word:
+				case MC_WordNumber: {
+					idx_t target = self;
+					if (!cell.name.empty()) {
+						const auto found = find_word(state, cell.name);
+						if (!has(found)) return false;
+						target = get(found);
+					}
+					push(state.code, cell.kind == MC_Word
+						? Value { .type = Value::Word, .word_idx = target }
+						: Value::new_number({ .pos = target }));
+				} break;
+				case MC_Primitive: {
+					push(state.code, Value::new_primitive(cell.payload));
+				} break;
+				case MC_Number: {
+					push(state.code, Value::new_number({ .pos = cell.payload }));
+				} break;
+				case MC_RawFunction: {
+					push(state.code, Value::new_function_ptr(raw_functions[cell.payload]));
+				} break;
+			}
+		}
+
+		state.define_word(
+			entry.name.data(), entry.name.size(),
+			entry.desc.data(), entry.desc.size(),
+			code_pos, entry.cells.size()
+		);
+	}
+
+	return true;
+}
+
+// prints where in the module an error happened, like main does for the line
+void report_module_error(const Interpreter &interpreter, const Module &module, const SourceView &source) {
+	if (!interpreter.state.error_handled) {
+		writechar(interpreter.state, '\n');
+		writestringl(interpreter.state, interpreter.state.error);
+	}
+
+	const char *at = interpreter.curr_word.len ? interpreter.curr_word.text : interpreter.line;
+	size_t line = 1, column = 1;
+	for (const char *ch = source.data; ch < at; ++ch) {
+		if (*ch == '\n') {
+			++line;
+			column = 1;
+		} else {
+			++column;
+		}
+	}
+	writestring(interpreter.state, "@ ");
+	writestring(interpreter.state, module.path.c_str());
+	writechar(interpreter.state, ':');
+	writenum_padded(interpreter.state, line, 0);
+	writechar(interpreter.state, ':');
+	writenum_padded(interpreter.state, column, 0);
+	writestring(interpreter.state, ": ");
+	for (size_t i = 0; i < interpreter.curr_word.len; ++i) writechar(interpreter.state, interpreter.curr_word.text[i]);
+	writestringl(interpreter.state, interpreter.curr_word.len ? "" : "end of file");
+}
+
+// whether the next item only defines something, so the module can still be cached
+bool next_only_defines(Interpreter &interpreter) {
+	if (has(interpreter.read_word_idx())) {
+		interpreter.curr_word.handled = false;
+		return false;
+	}
+	const auto syntax_idx = interpreter.read_syntax_idx();
+	interpreter.curr_word.handled = false;
+	return has(syntax_idx) && (
+		get(syntax_idx) == SC_WordDef
+		|| get(syntax_idx) == SC_Comment
+		|| get(syntax_idx) == SC_Include
+	);
+}
+
+void include_module(ProgramState &state, const std::string &path) {
+	// the innermost module still being included records the include either way
+	maybe_t<size_t> parent;
+	size_t depth = 0;
+	for (size_t i = state.modules.size(); i --> 0;) {
+		if (!state.modules[i].open) continue;
+		if (!has(parent)) parent = i;
+		++depth;
+	}
+	const idx_t at_word = length(state.words);
+
+	auto record = [&](size_t module_idx) {
+		if (!has(parent)) return;
+		Module &including = state.modules[get(parent)];
+		if (state.modules[module_idx].open) including.cacheable = false;
+		including.includes.push_back({
+			.module = module_idx,
+			.at_word = at_word,
+			.words = length(state.words) - at_word,
+		});
+	};
+
+	for (size_t i = 0; i < state.modules.size(); ++i) {
+		if (state.modules[i].path == path) {
+			record(i);
+			return;
+		}
+	}
+
+	if (depth > MODULE_MAX_DEPTH) {
+		state.error = "Error: includes are nested too deeply";
+		state.error_handled = false;
+		return;
+	}
+
+	// the key is looked up before the module counts as included
+	const auto key = state.module_cache_dir.empty() ? maybe_t<uint64_t> {} : cached_module_key(state, path, 0);
+	const auto object = has(key) ? read_module_object(state, path) : maybe_t<ModuleObject> {};
+
+	const DictionaryMark mark = dictionary_mark(state);
+	const size_t module_idx = state.modules.size();
+	state.modules.push_back({ .path = path, .words_begin = at_word });
+
+	if (has(object)) {
+		if (load_module_object(state, get(object))) {
+			state.modules[module_idx].key = get(key);
+			state.modules[module_idx].open = false;
+			record(module_idx);
+			return;
+		}
+		// compiling it from source is always an option
+		dictionary_restore(state, mark);
+		state.error = nullptr;
+		state.modules.push_back({ .path = path, .words_begin = at_word });
+	}
+
+	const auto mapped = map_source(path.c_str());
+	if (!has(mapped)) {
+		state.modules.pop_back();
+		state.error = "Error: could not read the included file";
+		state.error_handled = false;
+		return;
+	}
+	const SourceView source = get(mapped);
+
+	Interpreter interpreter {
+		.line = nullptr,
+		.len = 0,
+		.curr_word = {},
+		.state = state,
+	};
+	interpreter.set_source(source.data, source.len);
+	while (!state.error && interpreter.len > 0) {
+		if (state.modules[module_idx].cacheable && !next_only_defines(interpreter)) {
+			state.modules[module_idx].cacheable = false;
+		}
+		if (state.error) break;
+		interpreter.run_next();
+	}
+
+	if (state.error) {
+		report_module_error(interpreter, state.modules[module_idx], source);
+		state.error_handled = true;
+		unmap_source(source);
+		// the words stay, as they would on the prompt, but the module can be included again
+		state.modules.resize(module_idx);
+		return;
+	}
+
+	Module &module = state.modules[module_idx];
+	const uint64_t hash = fnv1a(FNV1A_INIT, source.data, source.len);
+	unmap_source(source);
+
+	module.key = hash;
+	for (const auto &include : module.includes) {
+		const uint64_t included_key = state.modules[include.module].key;
+		module.key = fnv1a(module.key, &included_key, sizeof(included_key));
+	}
+	module.open = false;
+
+	if (module.cacheable && !state.module_cache_dir.empty()) write_module_object(state, module, hash);
+
+	record(module_idx);
+}
+
+}
+
+void include_file(ProgramState &state, const char *path, size_t path_len) {
+	std::filesystem::path file(std::string(path, path_len));
+	if (file.is_relative()) {
+		for (size_t i = state.modules.size(); i --> 0;) {
+			if (state.modules[i].open) {
+				file = std::filesystem::path(state.modules[i].path).parent_path() / file;
+				break;
+			}
+		}
+	}
+
+	std::error_code ec;
+	const auto canonical = std::filesystem::canonical(file, ec);
+	if (ec) {
+		state.error = "Error: could not find the included file";
+		state.error_handled = false;
+		return;
+	}
+
+	include_module(state, canonical.string());
+}
+
+}
@@ -0,0 +1,241 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "./mieliepit.hpp"
+#include "./mieliepit_internal.hpp"
+
+namespace mieliepit {
+
+/*** SECTION: Native symbols ***/
+
+// the trampolines are only ever called in profiling builds, so the ordinary word
+// call doesn't check for them
+#if defined(MIELIEPIT_PROFILE) && defined(__linux__) && defined(__x86_64__)
+namespace {
+
+// push rbp; mov rbp, rsp; call rdx; pop rbp; ret
+// the frame pointer lets `perf record -g` unwind through the stub
+const uint8_t trampoline_code[] = { 0x55, 0x48, 0x89, 0xe5, 0xff, 0xd2, 0x5d, 0xc3 };
+constexpr size_t TRAMPOLINE_STRIDE = 16;
+constexpr size_t TRAMPOLINE_PAGE_SIZE = 4096;
+
+using trampoline_t = void (*)(ProgramState *state, idx_t word_idx, void (*run)(ProgramState *, idx_t));
+
+// jitdump format, see tools/perf/Documentation/jitdump-specification.txt in the kernel tree
+struct JitHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t total_size;
+	uint32_t elf_mach;
+	uint32_t pad1;
+	uint32_t pid;
+	uint64_t timestamp;
+	uint64_t flags;
+};
+struct JitCodeLoad {
+	uint32_t id;
+	uint32_t total_size;
+	uint64_t timestamp;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t vma;
+	uint64_t code_addr;
+	uint64_t code_size;
+	uint64_t code_index;
+	// followed by the name with its terminator, then the code itself
+};
+constexpr uint32_t JIT_MAGIC = 0x4a695444;
+constexpr uint32_t JIT_CODE_LOAD = 0;
+constexpr uint32_t JIT_ELF_MACH_X86_64 = 62;
+
+// a word's trampoline, named after the word that was at code_pos when it was made
+struct NativeStub {
+	trampoline_t fun;
+	idx_t code_pos;
+};
+
+struct NativeSymbols {
+	ProgramState *state = nullptr;
+	std::vector<NativeStub> stubs {}; // by word index, fun is nullptr until first called
+	std::vector<uint8_t *> pages {};
+	size_t page_used = TRAMPOLINE_PAGE_SIZE;
+	FILE *perf_map = nullptr;
+	FILE *jitdump = nullptr;
+	void *jitdump_marker = nullptr; // perf finds the dump through this mapping
+	uint64_t code_index = 0;
+} native_symbols;
+
+void jitdump_code_load(const char *name, const uint8_t *code, size_t code_size) {
+	const size_t name_size = strlen(name) + 1;
+	const JitCodeLoad record = {
+		.id = JIT_CODE_LOAD,
+		.total_size = (uint32_t)(sizeof(record) + name_size + code_size),
+		.timestamp = clock_ns(),
+		.pid = (uint32_t)getpid(),
+		.tid = (uint32_t)syscall(SYS_gettid),
+		.vma = (uint64_t)code,
+		.code_addr = (uint64_t)code,
+		.code_size = code_size,
+		.code_index = native_symbols.code_index++,
+	};
+	fwrite(&record, sizeof(record), 1, native_symbols.jitdump);
+	fwrite(name, name_size, 1, native_symbols.jitdump);
+	fwrite(code, code_size, 1, native_symbols.jitdump);
+	fflush(native_symbols.jitdump);
+}
+
+// creates the trampoline for a word and announces it, or returns nullptr if
+// no executable memory could be had
+trampoline_t make_trampoline(const ProgramState &state, idx_t word_idx) {
+	if (native_symbols.page_used + TRAMPOLINE_STRIDE > TRAMPOLINE_PAGE_SIZE) {
+		void *page = mmap(
+			nullptr, TRAMPOLINE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+		);
+		if (page == MAP_FAILED) return nullptr;
+		native_symbols.pages.push_back((uint8_t *)page);
+		native_symbols.page_used = 0;
+	} else if (mprotect(native_symbols.pages.back(), TRAMPOLINE_PAGE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+		return nullptr;
+	}
+
+	uint8_t *page = native_symbols.pages.back();
+	uint8_t *stub = page + native_symbols.page_used;
+	memcpy(stub, trampoline_code, sizeof(trampoline_code));
+	native_symbols.page_used += TRAMPOLINE_STRIDE;
+	if (mprotect(page, TRAMPOLINE_PAGE_SIZE, PROT_READ | PROT_EXEC) != 0) return nullptr;
+	__builtin___clear_cache((char *)stub, (char *)stub + sizeof(trampoline_code));
+
+	const std::string name = std::string("mieliepit:") + state.words[word_idx].name + " [interp]";
+	if (native_symbols.perf_map) {
+		fprintf(native_symbols.perf_map, "%lx %zx %s\n", (unsigned long)stub, sizeof(trampoline_code), name.c_str());
+		fflush(native_symbols.perf_map);
+	}
+	if (native_symbols.jitdump) jitdump_code_load(name.c_str(), stub, sizeof(trampoline_code));
+
+	return (trampoline_t)stub;
+}
+
+bool jitdump_open() {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+	native_symbols.jitdump = fopen(path, "w+");
+	if (native_symbols.jitdump == nullptr) return false;
+
+	const JitHeader header = {
+		.magic = JIT_MAGIC,
+		.version = 1,
+		.total_size = sizeof(header),
+		.elf_mach = JIT_ELF_MACH_X86_64,
+		.pad1 = 0,
+		.pid = (uint32_t)getpid(),
+		.timestamp = clock_ns(),
+		.flags = 0,
+	};
+	fwrite(&header, sizeof(header), 1, native_symbols.jitdump);
+	fflush(native_symbols.jitdump);
+
+	// an executable mapping of the file is what tells perf record about it
+	native_symbols.jitdump_marker = mmap(
+		nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE,
+		fileno(native_symbols.jitdump), 0
+	);
+	if (native_symbols.jitdump_marker == MAP_FAILED) {
+		native_symbols.jitdump_marker = nullptr;
+		fclose(native_symbols.jitdump);
+		native_symbols.jitdump = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+}
+
+void run_word_via_trampoline(idx_t word_idx, ProgramState &state) {
+	if (native_symbols.state != &state) {
+		run_word_code(&state, word_idx);
+		return;
+	}
+
+	while (native_symbols.stubs.size() <= word_idx) native_symbols.stubs.push_back({ nullptr, 0 });
+	// a word replaced since (by load_image, say) has its code elsewhere, and gets a stub of its own
+	NativeStub &cached = native_symbols.stubs[word_idx];
+	const idx_t code_pos = state.words[word_idx].code_pos;
+	if (cached.fun == nullptr || cached.code_pos != code_pos) {
+		cached = { make_trampoline(state, word_idx), code_pos };
+	}
+	const trampoline_t stub = cached.fun;
+
+	if (stub) {
+		stub(&state, word_idx, run_word_code);
+	} else {
+		run_word_code(&state, word_idx);
+	}
+}
+
+// drops the stubs of state's words, once they have all been replaced
+void native_symbols_forget(const ProgramState &state) {
+	if (native_symbols.state == &state) native_symbols.stubs.clear();
+}
+
+bool native_symbols_start(ProgramState &state, bool jitdump) {
+	native_symbols_stop();
+
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+	native_symbols.perf_map = fopen(path, "w");
+	if (native_symbols.perf_map == nullptr) return false;
+
+	if (jitdump && !jitdump_open()) {
+		native_symbols_stop();
+		return false;
+	}
+
+	native_symbols.state = &state;
+	state.trampolines = true;
+	return true;
+}
+
+void native_symbols_stop() {
+	if (native_symbols.state) native_symbols.state->trampolines = false;
+	native_symbols.state = nullptr;
+
+	// the map files stay behind for perf report; the stubs can't be called anymore
+	if (native_symbols.perf_map) fclose(native_symbols.perf_map);
+	native_symbols.perf_map = nullptr;
+	if (native_symbols.jitdump_marker) munmap(native_symbols.jitdump_marker, sysconf(_SC_PAGESIZE));
+	native_symbols.jitdump_marker = nullptr;
+	if (native_symbols.jitdump) fclose(native_symbols.jitdump);
+	native_symbols.jitdump = nullptr;
+
+	for (uint8_t *page : native_symbols.pages) munmap(page, TRAMPOLINE_PAGE_SIZE);
+	native_symbols.pages.clear();
+	native_symbols.page_used = TRAMPOLINE_PAGE_SIZE;
+	native_symbols.stubs.clear();
+}
+#else
+#ifdef MIELIEPIT_PROFILE
+void run_word_via_trampoline(idx_t word_idx, ProgramState &state) {
+	run_word_code(&state, word_idx);
+}
+#endif
+
+void native_symbols_forget(const ProgramState &) { }
+
+bool native_symbols_start(ProgramState &, bool) {
+	return false;
+}
+
+void native_symbols_stop() { }
+#endif
+
+}
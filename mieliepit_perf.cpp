@@ -0,0 +1,149 @@
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "./mieliepit.hpp"
+#include "./mieliepit_internal.hpp"
+
+namespace mieliepit {
+
+/*** SECTION: Hardware counters ***/
+
+#ifndef __linux__
+bool perf_open() { return false; }
+void perf_close() { }
+const char *perf_error() {
+	return "hardware counters are not supported on this platform";
+}
+bool perf_counter_available(PerfCounter) { return false; }
+bool perf_read(PerfCounts &counts) {
+	for (size_t i = 0; i < PC_COUNT; ++i) counts.counts[i] = 0;
+	return false;
+}
+#else
+namespace {
+
+// all counters are opened in one group, so they can be read with a single read()
+struct Perf {
+	bool opened = false;
+	int leader = -1;
+	int fds[PC_COUNT] = { -1, -1, -1, -1, -1 };
+	size_t slots[PC_COUNT] = {}; // position in the group read
+	size_t members = 0;
+	char error[128] = "hardware counters have not been opened";
+} perf;
+
+perf_event_attr perf_attr(PerfCounter counter) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+
+	constexpr uint64_t cache_read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	switch (counter) {
+		case PC_Instructions: {
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		} break;
+		case PC_Cycles: {
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		} break;
+		case PC_BranchMisses: {
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		} break;
+		case PC_L1dMisses: {
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_L1D | cache_read_miss;
+		} break;
+		case PC_LLCMisses: {
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_LL | cache_read_miss;
+		} break;
+		case PC_COUNT: assert(false);
+	}
+
+	return attr;
+}
+
+}
+
+bool perf_open() {
+	if (perf.opened) return perf.leader != -1;
+	perf.opened = true;
+
+	int first_errno = 0;
+	for (size_t i = 0; i < PC_COUNT; ++i) {
+		perf_event_attr attr = perf_attr((PerfCounter)i);
+		const int fd = syscall(SYS_perf_event_open, &attr, 0, -1, perf.leader, 0);
+		if (fd == -1) {
+			if (first_errno == 0) first_errno = errno;
+			continue;
+		}
+
+		if (perf.leader == -1) perf.leader = fd;
+		perf.fds[i] = fd;
+		perf.slots[i] = perf.members++;
+	}
+
+	if (perf.leader == -1) {
+		snprintf(
+			perf.error, sizeof(perf.error), "perf_event_open failed: %s%s",
+			strerror(first_errno),
+			first_errno == EACCES || first_errno == EPERM
+				? " (see /proc/sys/kernel/perf_event_paranoid)"
+				: ""
+		);
+		return false;
+	}
+
+	perf.error[0] = 0;
+	return true;
+}
+
+void perf_close() {
+	for (size_t i = 0; i < PC_COUNT; ++i) {
+		if (perf.fds[i] != -1 && perf.fds[i] != perf.leader) close(perf.fds[i]);
+		perf.fds[i] = -1;
+	}
+	if (perf.leader != -1) close(perf.leader);
+	perf.leader = -1;
+	perf.members = 0;
+	perf.opened = false;
+	snprintf(perf.error, sizeof(perf.error), "hardware counters have not been opened");
+}
+
+const char *perf_error() {
+	return perf.error;
+}
+
+bool perf_counter_available(PerfCounter counter) {
+	return perf.fds[counter] != -1;
+}
+
+bool perf_read(PerfCounts &counts) {
+	uint64_t buf[1 + PC_COUNT]; // number of members, then their values
+	if (perf.leader == -1 || read(perf.leader, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) {
+		for (size_t i = 0; i < PC_COUNT; ++i) counts.counts[i] = 0;
+		return false;
+	}
+
+	for (size_t i = 0; i < PC_COUNT; ++i) {
+		counts.counts[i] = perf.fds[i] != -1 ? buf[1 + perf.slots[i]] : 0;
+	}
+	return true;
+}
+#endif
+
+}
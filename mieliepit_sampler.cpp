@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "./mieliepit.hpp"
+#include "./mieliepit_internal.hpp"
+
+namespace mieliepit {
+
+/*** SECTION: Sampling profiler ***/
+
+namespace {
+
+constexpr size_t SAMPLE_MAX_DEPTH = 32;
+constexpr size_t SAMPLE_BUFFER_SIZE = 1 << 14;
+// how often the buffer is emptied while sampling; at the default 997 Hz it holds about 16 s
+constexpr auto SAMPLE_DRAIN_INTERVAL = std::chrono::milliseconds(100);
+
+struct SampleFrame {
+	idx_t word_idx;
+	idx_t code_offset;
+};
+
+struct Sample {
+	size_t depth; // number of frames recorded, innermost first
+	bool truncated;
+	SampleFrame frames[SAMPLE_MAX_DEPTH];
+};
+
+struct Sampler {
+	// a ring of SAMPLE_BUFFER_SIZE samples: the signal handler writes at head,
+	// sampler_drain reads from tail up to head
+	ProgramState *volatile state = nullptr;
+	pthread_t thread; // the one running state, the only one the handler samples on
+	Sample *buffer = nullptr;
+	std::atomic<size_t> head = 0;
+	std::atomic<size_t> tail = 0;
+	std::atomic<size_t> dropped = 0;
+
+	// aggregated outside of the signal handler, see sampler_drain
+	std::mutex lock; // for the tables and tail
+	size_t total = 0;
+	std::map<std::vector<idx_t>, size_t> stacks {}; // outermost first
+	std::map<pair<idx_t, idx_t>, size_t> leaves {}; // (word, code offset)
+
+	// drains the buffer every SAMPLE_DRAIN_INTERVAL while sampling
+	std::thread drainer;
+	std::mutex drainer_lock;
+	std::condition_variable drainer_wake;
+	bool stopping = false;
+} sampler;
+
+void sampler_handler(int) {
+	ProgramState *state = sampler.state;
+	if (state == nullptr || !pthread_equal(pthread_self(), sampler.thread)) return;
+
+	const size_t head = sampler.head.load(std::memory_order_relaxed);
+	if (head - sampler.tail.load(std::memory_order_acquire) >= SAMPLE_BUFFER_SIZE) {
+		sampler.dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	Sample &sample = sampler.buffer[head % SAMPLE_BUFFER_SIZE];
+	sample.depth = 0;
+	sample.truncated = false;
+	const Value *code_start = state->code.data();
+	for (const Runner *runner = state->running; runner != nullptr; runner = runner->parent) {
+		if (sample.depth == SAMPLE_MAX_DEPTH) {
+			sample.truncated = true;
+			break;
+		}
+		sample.frames[sample.depth++] = {
+			.word_idx = runner->word_idx,
+			.code_offset = (idx_t)(runner->curr.code - code_start),
+		};
+	}
+	sampler.head.store(head + 1, std::memory_order_release);
+}
+
+// moves samples from the signal handler's buffer into the aggregate tables, with
+// sampler.lock held. The handler only writes past head, so it needn't be blocked
+void sampler_drain() {
+	const size_t head = sampler.head.load(std::memory_order_acquire);
+	for (size_t i = sampler.tail.load(std::memory_order_relaxed); i != head; ++i) {
+		const Sample &sample = sampler.buffer[i % SAMPLE_BUFFER_SIZE];
+
+		std::vector<idx_t> stack;
+		if (sample.truncated) stack.push_back(NO_WORD - 1);
+		size_t j = sample.depth;
+		while (j --> 0) stack.push_back(sample.frames[j].word_idx);
+		++sampler.stacks[stack];
+
+		if (sample.depth > 0) {
+			++sampler.leaves[{ sample.frames[0].word_idx, sample.frames[0].code_offset }];
+		}
+		++sampler.total;
+	}
+	sampler.tail.store(head, std::memory_order_release);
+}
+
+void sampler_drain_loop() {
+	std::unique_lock<std::mutex> wake_guard(sampler.drainer_lock);
+	while (!sampler.stopping) {
+		sampler.drainer_wake.wait_for(wake_guard, SAMPLE_DRAIN_INTERVAL);
+		std::lock_guard<std::mutex> guard(sampler.lock);
+		sampler_drain();
+	}
+}
+
+std::string sample_frame_name(const ProgramState &state, idx_t word_idx) {
+	if (word_idx == NO_WORD) return "<block>";
+	if (word_idx == NO_WORD - 1) return "<truncated>";
+	if (word_idx >= length(state.words)) return "<unknown>";
+	return state.words[word_idx].name;
+}
+
+}
+
+bool sampler_start(ProgramState &state, unsigned hz) {
+	if (hz == 0 || sampler.state != nullptr) return false;
+
+	if (sampler.buffer == nullptr) {
+		sampler.buffer = (Sample *)malloc(sizeof(Sample) * SAMPLE_BUFFER_SIZE);
+		if (sampler.buffer == nullptr) return false;
+	}
+
+	struct sigaction action {};
+	action.sa_handler = sampler_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, nullptr) != 0) return false;
+
+	sampler.thread = pthread_self();
+	sampler.stopping = false;
+	// the drainer starts with SIGPROF blocked, so that the timer signals this thread
+	sigset_t block, old;
+	sigemptyset(&block);
+	sigaddset(&block, SIGPROF);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	sampler.drainer = std::thread(sampler_drain_loop);
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+	sampler.state = &state;
+
+	itimerval timer {};
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+		sampler_stop();
+		return false;
+	}
+
+	return true;
+}
+
+void sampler_stop() {
+	itimerval timer {};
+	setitimer(ITIMER_PROF, &timer, nullptr);
+	sampler.state = nullptr;
+
+	if (sampler.drainer.joinable()) {
+		{
+			std::lock_guard<std::mutex> wake_guard(sampler.drainer_lock);
+			sampler.stopping = true;
+		}
+		sampler.drainer_wake.notify_one();
+		sampler.drainer.join();
+	}
+
+	std::lock_guard<std::mutex> guard(sampler.lock);
+	sampler_drain();
+}
+
+void sampler_reset() {
+	std::lock_guard<std::mutex> guard(sampler.lock);
+	sampler_drain();
+	sampler.total = 0;
+	sampler.dropped = 0;
+	sampler.stacks.clear();
+	sampler.leaves.clear();
+}
+
+void sampler_print_flat(const ProgramState &state) {
+	std::lock_guard<std::mutex> guard(sampler.lock);
+	sampler_drain();
+
+	std::map<idx_t, pair<size_t, size_t>> per_word {}; // self, total
+	for (const auto &[stack, count] : sampler.stacks) {
+		if (stack.empty()) continue;
+		per_word[stack.back()].first += count;
+
+		std::vector<idx_t> seen {};
+		for (const idx_t word_idx : stack) {
+			if (std::find(seen.begin(), seen.end(), word_idx) != seen.end()) continue;
+			seen.push_back(word_idx);
+			per_word[word_idx].second += count;
+		}
+	}
+
+	std::vector<pair<idx_t, pair<size_t, size_t>>> rows(per_word.begin(), per_word.end());
+	std::sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) {
+		return a.second.first > b.second.first;
+	});
+
+	const size_t total = sampler.total ? sampler.total : 1;
+	char percent[32];
+	writenum_padded(state, sampler.total, 0);
+	writestring(state, " samples");
+	if (sampler.dropped) {
+		writestring(state, " (");
+		writenum_padded(state, sampler.dropped.load(), 0);
+		writestring(state, " dropped)");
+	}
+	writestringl(state, "\n   self%  total%  name");
+	for (const auto &[word_idx, counts] : rows) {
+		snprintf(percent, sizeof(percent), "%8.2f%8.2f  ", 100.0 * counts.first / total, 100.0 * counts.second / total);
+		writestring(state, percent);
+		writestringl(state, sample_frame_name(state, word_idx).c_str());
+	}
+
+	std::vector<pair<pair<idx_t, idx_t>, size_t>> leaves(sampler.leaves.begin(), sampler.leaves.end());
+	std::sort(leaves.begin(), leaves.end(), [](const auto &a, const auto &b) {
+		return a.second > b.second;
+	});
+	if (leaves.size() > 10) leaves.resize(10);
+	writestringl(state, "hottest code positions:");
+	for (const auto &[at, count] : leaves) {
+		snprintf(percent, sizeof(percent), "%8.2f  ", 100.0 * count / total);
+		writestring(state, percent);
+		writestring(state, sample_frame_name(state, at.first).c_str());
+		writestring(state, " @ code ");
+		writenum_padded(state, at.second, 0);
+		writechar(state, '\n');
+	}
+}
+
+bool sampler_write_folded(const ProgramState &state, const char *path) {
+	std::lock_guard<std::mutex> guard(sampler.lock);
+	sampler_drain();
+
+	std::ofstream out(path);
+	if (!out) return false;
+
+	for (const auto &[stack, count] : sampler.stacks) {
+		out << "mieliepit";
+		if (stack.empty()) out << ";<interpreter>";
+		for (const idx_t word_idx : stack) {
+			out << ';' << sample_frame_name(state, word_idx);
+		}
+		out << ' ' << count << '\n';
+	}
+
+	return static_cast<bool>(out);
+}
+
+}
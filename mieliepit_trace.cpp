@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "./mieliepit.hpp"
+#include "./mieliepit_internal.hpp"
+
+namespace mieliepit {
+
+/*** SECTION: Trace dumps ***/
+
+namespace {
+
+constexpr char TRACE_MAGIC[8] = { 'M', 'P', 'T', 'R', 'A', 'C', 'E', '1' };
+
+}
+
+// File layout, all integers are host-endian u64:
+//   magic, record count,
+//   word count, (code_pos, name) per word,
+//   primitive count, name per primitive,
+//   syntax count, name per syntax item,
+//   raw function count, name per raw function,
+//   (word_idx, code_offset, type, payload, top, stack_len) per record.
+// Raw function payloads are indices into the raw function names,
+// since the pointers mean nothing outside of this process.
+bool trace_dump(const ProgramState &state, const char *path, size_t n) {
+	const uint64_t available = state.trace.head < TRACE_RING_SIZE
+		? state.trace.head
+		: TRACE_RING_SIZE;
+	if (n > available) n = available;
+
+	std::vector<function_ptr_t> raw_functions {};
+	std::vector<TraceRecord> records {};
+	for (uint64_t i = state.trace.head - n; i < state.trace.head; ++i) {
+		TraceRecord record = state.trace.records[i & (TRACE_RING_SIZE-1)];
+		if (record.value.type == Value::RawFunction) {
+			const auto found = std::find(raw_functions.begin(), raw_functions.end(), record.value.function_ptr);
+			record.value.raw_value = found - raw_functions.begin();
+			if (found == raw_functions.end()) raw_functions.push_back(record.value.function_ptr);
+		}
+		records.push_back(record);
+	}
+
+	std::ofstream out(path, std::ios::binary);
+	if (!out) return false;
+
+	out.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	write_u64(out, records.size());
+
+	write_u64(out, length(state.words));
+	for (idx_t i = 0; i < length(state.words); ++i) {
+		write_u64(out, state.words[i].code_pos);
+		write_str(out, state.words[i].name);
+	}
+	write_u64(out, state.primitives_len);
+	for (idx_t i = 0; i < state.primitives_len; ++i) write_str(out, state.primitives[i].name);
+	write_u64(out, state.syntax_len);
+	for (idx_t i = 0; i < state.syntax_len; ++i) write_str(out, state.syntax[i].name);
+	write_u64(out, raw_functions.size());
+	for (const auto function_ptr : raw_functions) write_str(out, function_ptr->name);
+
+	for (const auto &record : records) {
+		write_u64(out, record.word_idx);
+		write_u64(out, record.code_offset);
+		write_u64(out, record.value.type);
+		write_u64(out, record.value.raw_value);
+		write_u64(out, record.top.pos);
+		write_u64(out, record.stack_len);
+	}
+
+	return static_cast<bool>(out);
+}
+
+bool trace_decode(const char *path) {
+	std::ifstream in(path, std::ios::binary);
+	char magic[sizeof(TRACE_MAGIC)];
+	if (!in.read(magic, sizeof(magic)) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) return false;
+
+	uint64_t records_len;
+	if (!read_u64(in, records_len)) return false;
+
+	uint64_t len;
+	std::vector<pair<uint64_t, std::string>> words {};
+	if (!read_u64(in, len)) return false;
+	for (uint64_t i = 0; i < len; ++i) {
+		pair<uint64_t, std::string> word;
+		if (!read_u64(in, word.first) || !read_str(in, word.second)) return false;
+		words.push_back(word);
+	}
+	std::vector<std::string> names[3] {}; // primitives, syntax, raw functions
+	for (auto &table : names) {
+		if (!read_u64(in, len)) return false;
+		table.resize(len);
+		for (auto &name : table) if (!read_str(in, name)) return false;
+	}
+	const auto name_in = [](const std::vector<std::string> &table, uint64_t idx) {
+		return idx < table.size() ? table[idx] : "<unknown>";
+	};
+
+	for (uint64_t i = 0; i < records_len; ++i) {
+		uint64_t word_idx, code_offset, type, payload, top, stack_len;
+		if (!read_u64(in, word_idx) || !read_u64(in, code_offset)
+			|| !read_u64(in, type) || !read_u64(in, payload)
+			|| !read_u64(in, top) || !read_u64(in, stack_len)) return false;
+
+		if (code_offset == NO_WORD) {
+			std::cout << "<interpreter>";
+		} else if (word_idx >= words.size()) {
+			std::cout << "<block>@" << code_offset;
+		} else {
+			std::cout << words[word_idx].second << '+' << code_offset - words[word_idx].first;
+		}
+		std::cout << ": ";
+		switch (type) {
+			case Value::Word: {
+				std::cout << (payload < words.size() ? words[payload].second : "<unknown>");
+			} break;
+			case Value::Primitive: std::cout << name_in(names[0], payload); break;
+			case Value::Syntax: std::cout << name_in(names[1], payload); break;
+			case Value::Number: std::cout << payload; break;
+			case Value::RawFunction: std::cout << name_in(names[2], payload); break;
+			default: std::cout << "<bad value type " << type << '>'; break;
+		}
+		std::cout << "  ( depth " << stack_len << ", top " << (int64_t)top << " )\n";
+	}
+
+	return true;
+}
+
+}